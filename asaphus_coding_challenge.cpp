@@ -33,20 +33,103 @@
  * - Feel free to add more test cases, if you would like to test more.
  * - This file includes the header-only test framework Catch v2.13.9.
  * - A main function is not required, as it is provided by the test framework.
+ * - Defining ASAPHUS_NO_TESTS leaves out the test framework, e.g. to build the C API library (game_c_api.h).
+ * - Vectorized kernels are picked by CPUID at startup; ASAPHUS_FORCE_ISA=baseline|sse4.2|avx2|avx512 forces one.
+ * - Defining ASAPHUS_BATCH_TOOL together with ASAPHUS_NO_TESTS builds the partition-mode shard/merge tool instead.
+ * - USDT probes (provider "asaphus") are built in when <sys/sdt.h> is available; ASAPHUS_NO_PROBES leaves them out.
+ *   With systemtap-sdt-dev (Debian/Ubuntu) or systemtap-sdt-devel (Fedora) installed, build the probe variant with
+ *   g++ --std=c++14 -O2 -DASAPHUS_REQUIRE_PROBES asaphus_coding_challenge.cpp -o challenge && ./challenge "[probes]"
+ *   ASAPHUS_REQUIRE_PROBES turns a missing header into a build error instead of a silent probe-free build.
  */
 
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <limits>
 #include <list>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#if defined(__has_include) && !defined(ASAPHUS_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define ASAPHUS_HAVE_PROBES 1
+#endif
+#endif
+#if defined(ASAPHUS_REQUIRE_PROBES) && !defined(ASAPHUS_HAVE_PROBES)
+#error "ASAPHUS_REQUIRE_PROBES is set, but <sys/sdt.h> was not found (install systemtap-sdt-dev)"
+#endif
+
+#include "game_c_api.h"
+
+#ifndef ASAPHUS_NO_TESTS
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
+#endif
+
+/**
+ * Static tracepoints of provider "asaphus" for SystemTap, perf and bpftrace, e.g.
+ * `bpftrace -e 'usdt:./challenge:asaphus:turn { @[arg1] = count(); }' -p PID`.
+ * Each is a single nop plus an ELF note until a tracer patches it, and nothing at all
+ * without <sys/sdt.h>. Scores are passed as their IEEE-754 bits (see doubleBits()).
+ *
+ * - game_start(engine name, token count)
+ * - game_end(engine name, score A bits, score B bits)
+ * - turn(turn index, box index, score bits), from the GameState and two-phase engines
+ * - batch_chunk_start / batch_chunk_end(worker, first game, end game)
+ */
+#ifdef ASAPHUS_HAVE_PROBES
+#define ASAPHUS_PROBE2(name, a, b) STAP_PROBE2(asaphus, name, a, b)
+#define ASAPHUS_PROBE3(name, a, b, c) STAP_PROBE3(asaphus, name, a, b, c)
+#else
+#define ASAPHUS_PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define ASAPHUS_PROBE3(name, a, b, c) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#endif
 
+/**
+ * IEEE-754 bit pattern of a double.
+ */
+inline uint64_t doubleBits(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
 
 /**
  * Base class representing a Box.
@@ -61,7 +144,22 @@ public:
 
     static std::unique_ptr<Box> makeBlueBox(double initial_weight);
 
-    bool operator<(const Box& rhs) const { return weight_ < rhs.weight_; }
+    /**
+     * Blue box scoring on the smallest and largest of the last `window` absorbed weights.
+     */
+    static std::unique_ptr<Box> makeWindowedBlueBox(double initial_weight, size_t window);
+
+    /**
+     * Green box scoring the square of the q-quantile (linearly interpolated) of the
+     * last `window` absorbed weights; q = 0.5 gives the median.
+     */
+    static std::unique_ptr<Box> makeWindowedQuantileBox(double initial_weight, size_t window, double q);
+
+    bool operator<(const Box& rhs) const {
+        // Boxes of one game are rebased together, so their relative weights compare exactly
+        if (offset_ == rhs.offset_) return weight_ < rhs.weight_;
+        return getWeight() < rhs.getWeight();
+    }
 
     /**
      * Absorbs the given weight into the Box.
@@ -71,12 +169,33 @@ public:
         return 0;
     }
 
+    /**
+     * Score the Box would output if it absorbed the given weight, without absorbing it.
+     */
+    virtual double previewScore(double weight) const = 0;
+
     /**
      * Retrieves the weight of the Box.
      */
 
     double getWeight() const {
-        return weight_;
+        return static_cast<double>(offset_) + weight_;
+    }
+
+    /**
+     * Weight above the offset that rebase() has moved out of the Box.
+     */
+    double getRelativeWeight() const { return weight_; }
+
+    uint64_t getWeightOffset() const { return offset_; }
+
+    /**
+     * Moves a whole amount, at most the relative weight, from the weight into the offset.
+     * getWeight() is unchanged, while the relative weight stays small enough for exact sums.
+     */
+    void rebase(uint64_t amount) {
+        weight_ -= static_cast<double>(amount);
+        offset_ += amount;
     }
 
 private:
@@ -88,6 +207,9 @@ private:
 
  protected:
   double weight_;
+
+ private:
+  uint64_t offset_ = 0;
 };
 
 /**
@@ -135,6 +257,18 @@ public:
         return calculateScore();
     }
 
+    double previewScore(double weight) const override {
+        // Same summation order as mean() over the window after absorbing
+        size_t first = recentWeights.size() == 3 ? 1 : 0;
+        double sum = 0;
+        for (size_t i = first; i < recentWeights.size(); ++i) {
+            sum += recentWeights[i];
+        }
+        sum += weight;
+        double m = sum / (recentWeights.size() - first + 1);
+        return m * m;
+    }
+
 private:
     double calculateScore() const override {
         double m = mean(recentWeights);
@@ -163,6 +297,13 @@ public:
         return calculateScore();
     }
 
+    double previewScore(double weight) const override {
+        if (!absorbedAtLeastOneWeight) {
+            return cantorPairing(weight, weight);
+        }
+        return cantorPairing(std::min(minWeight, weight), std::max(maxWeight, weight));
+    }
+
 private:
     double minWeight, maxWeight;
     bool absorbedAtLeastOneWeight;
@@ -172,6 +313,276 @@ private:
     }
 };
 
+/**
+ * Sliding-window extremum over a stream: a monotonic deque in a ring buffer sized
+ * once to the window, so push() never allocates and costs O(1) amortized.
+ * Better(a, b) is true if a should replace b as the extremum (std::less for the minimum).
+ */
+template <typename Better>
+class MonotonicWindow {
+public:
+    explicit MonotonicWindow(size_t window)
+        : window_(window), values_(new double[window]), positions_(new uint64_t[window]) {}
+
+    /**
+     * Appends the value at stream position `position` (positions increase by one per push).
+     */
+    void push(uint64_t position, double value) {
+        // Older entries no better than the new value can never be the extremum again
+        while (size_ > 0 && !Better()(at(size_ - 1), value)) --size_;
+        if (size_ > 0 && positions_[head_] + window_ <= position) {
+            head_ = (head_ + 1) % window_;
+            --size_;
+        }
+        size_t tail = (head_ + size_) % window_;
+        values_[tail] = value;
+        positions_[tail] = position;
+        ++size_;
+    }
+
+    /**
+     * Extremum of the window ending at the last pushed position.
+     */
+    double best() const { return values_[head_]; }
+
+    /**
+     * Extremum of the window that would end at `position` if `value` were pushed there.
+     */
+    double preview(uint64_t position, double value) const {
+        size_t first = size_ > 0 && positions_[head_] + window_ <= position ? 1 : 0;
+        if (first == size_) return value;
+        double current = at(first);
+        return Better()(value, current) ? value : current;
+    }
+
+private:
+    double at(size_t i) const { return values_[(head_ + i) % window_]; }
+
+    size_t window_;
+    std::unique_ptr<double[]> values_;
+    std::unique_ptr<uint64_t[]> positions_;
+    size_t head_ = 0;
+    size_t size_ = 0;
+};
+
+/**
+ * Blue box variant whose score pairs the smallest and largest of the last W absorbed
+ * weights instead of all of them.
+ */
+class WindowedBlueBox : public Box {
+public:
+    WindowedBlueBox(double initial_weight, size_t window)
+        : Box(initial_weight), minima_(window), maxima_(window) {}
+
+    double absorb(double weight) override {
+        Box::absorb(weight);
+        minima_.push(absorbed_, weight);
+        maxima_.push(absorbed_, weight);
+        ++absorbed_;
+        return calculateScore();
+    }
+
+    double previewScore(double weight) const override {
+        return cantorPairing(minima_.preview(absorbed_, weight), maxima_.preview(absorbed_, weight));
+    }
+
+private:
+    MonotonicWindow<std::less<double> > minima_;
+    MonotonicWindow<std::greater<double> > maxima_;
+    uint64_t absorbed_ = 0;
+
+    double calculateScore() const override {
+        return cantorPairing(minima_.best(), maxima_.best());
+    }
+};
+
+/**
+ * Order statistics over the last W values of a stream, kept in a treap with subtree
+ * sizes. Each stream position owns a fixed node slot, so the node pool is allocated
+ * once and insert, erase and select are O(log W) expected.
+ */
+class OrderStatisticWindow {
+public:
+    explicit OrderStatisticWindow(size_t window) : window_(window), nodes_(new Node[window + 1]()) {}
+
+    size_t size() const { return nodes_[root_].size; }
+
+    /**
+     * Appends the value at the next stream position, dropping the one that leaves the window.
+     */
+    void push(double value) {
+        if (pushed_ >= window_) {
+            const Node& old = nodes_[slot(pushed_ - window_)];
+            erase(root_, old.value, old.position);
+        }
+        uint32_t node = slot(pushed_);
+        nodes_[node] = { value, pushed_, priority(pushed_), 1, 0, 0 };
+        uint32_t less, greater;
+        split(root_, value, pushed_, less, greater);
+        root_ = merge(merge(less, node), greater);
+        ++pushed_;
+    }
+
+    /**
+     * k-th smallest (0-based) value in the window.
+     */
+    double select(size_t k) const {
+        uint32_t t = root_;
+        for (;;) {
+            size_t left = nodes_[nodes_[t].left].size;
+            if (k < left) {
+                t = nodes_[t].left;
+            }
+            else if (k == left) {
+                return nodes_[t].value;
+            }
+            else {
+                k -= left + 1;
+                t = nodes_[t].right;
+            }
+        }
+    }
+
+    /**
+     * k-th smallest value of the window that push(value) would produce, without pushing.
+     */
+    double previewSelect(size_t k, double value) const {
+        // Rank of value among the entries that would stay, and of the entry that would leave
+        bool drops = pushed_ >= window_;
+        size_t dropRank = 0;
+        size_t valueRank = rank(value, pushed_);
+        if (drops) {
+            const Node& old = nodes_[slot(pushed_ - window_)];
+            dropRank = rank(old.value, old.position);
+            if (isLess(old, value, pushed_)) --valueRank;
+        }
+        if (k == valueRank) return value;
+        size_t kept = k < valueRank ? k : k - 1;
+        return select(drops && kept >= dropRank ? kept + 1 : kept);
+    }
+
+private:
+    struct Node {
+        double value;
+        uint64_t position;
+        uint32_t priority, size, left, right;
+    };
+
+    uint32_t slot(uint64_t position) const { return static_cast<uint32_t>(position % window_) + 1; }
+
+    static uint32_t priority(uint64_t position) {
+        position ^= position >> 33;
+        position *= 0xff51afd7ed558ccdULL;
+        position ^= position >> 33;
+        return static_cast<uint32_t>(position);
+    }
+
+    // Entries are ordered by value, then by stream position
+    static bool isLess(const Node& node, double value, uint64_t position) {
+        return node.value < value || (node.value == value && node.position < position);
+    }
+
+    void update(uint32_t t) { nodes_[t].size = 1 + nodes_[nodes_[t].left].size + nodes_[nodes_[t].right].size; }
+
+    uint32_t merge(uint32_t a, uint32_t b) {
+        if (a == 0 || b == 0) return a | b;
+        if (nodes_[a].priority > nodes_[b].priority) {
+            nodes_[a].right = merge(nodes_[a].right, b);
+            update(a);
+            return a;
+        }
+        nodes_[b].left = merge(a, nodes_[b].left);
+        update(b);
+        return b;
+    }
+
+    // Splits t into the entries ordered before (value, position) and the rest
+    void split(uint32_t t, double value, uint64_t position, uint32_t& less, uint32_t& rest) {
+        if (t == 0) {
+            less = rest = 0;
+            return;
+        }
+        if (isLess(nodes_[t], value, position)) {
+            split(nodes_[t].right, value, position, nodes_[t].right, rest);
+            less = t;
+        }
+        else {
+            split(nodes_[t].left, value, position, less, nodes_[t].left);
+            rest = t;
+        }
+        update(t);
+    }
+
+    void erase(uint32_t& t, double value, uint64_t position) {
+        Node& node = nodes_[t];
+        if (node.value == value && node.position == position) {
+            t = merge(node.left, node.right);
+            return;
+        }
+        erase(isLess(node, value, position) ? node.right : node.left, value, position);
+        update(t);
+    }
+
+    // Number of entries ordered before (value, position)
+    size_t rank(double value, uint64_t position) const {
+        size_t count = 0;
+        for (uint32_t t = root_; t != 0;) {
+            if (isLess(nodes_[t], value, position)) {
+                count += nodes_[nodes_[t].left].size + 1;
+                t = nodes_[t].right;
+            }
+            else {
+                t = nodes_[t].left;
+            }
+        }
+        return count;
+    }
+
+    size_t window_;
+    std::unique_ptr<Node[]> nodes_;  // slot 0 is the empty tree
+    uint32_t root_ = 0;
+    uint64_t pushed_ = 0;
+};
+
+/**
+ * Green box variant scoring the square of a quantile of the last W absorbed weights,
+ * interpolating linearly between neighbouring order statistics.
+ */
+class WindowedQuantileBox : public Box {
+public:
+    WindowedQuantileBox(double initial_weight, size_t window, double q)
+        : Box(initial_weight), window_(window), q_(q), weights_(window) {}
+
+    double absorb(double weight) override {
+        Box::absorb(weight);
+        weights_.push(weight);
+        return calculateScore();
+    }
+
+    double previewScore(double weight) const override {
+        size_t count = std::min(weights_.size() + 1, window_);
+        return score(count, [this, weight](size_t k) { return weights_.previewSelect(k, weight); });
+    }
+
+private:
+    size_t window_;
+    double q_;
+    OrderStatisticWindow weights_;
+
+    template <typename Select>
+    double score(size_t count, Select select) const {
+        double h = q_ * (count - 1);
+        size_t lower = static_cast<size_t>(h);
+        double value = select(lower);
+        if (lower + 1 < count) value += (h - lower) * (select(lower + 1) - value);
+        return value * value;
+    }
+
+    double calculateScore() const override {
+        return score(weights_.size(), [this](size_t k) { return weights_.select(k); });
+    }
+};
+
 // Factory method to create a green box with the given initial weight
 std::unique_ptr<Box> Box::makeGreenBox(double initial_weight) {
     return std::make_unique<GreenBox>(initial_weight);
@@ -182,12 +593,161 @@ std::unique_ptr<Box> Box::makeBlueBox(double initial_weight) {
     return std::make_unique<BlueBox>(initial_weight);
 }
 
+// Factory method to create a windowed blue box with the given initial weight
+std::unique_ptr<Box> Box::makeWindowedBlueBox(double initial_weight, size_t window) {
+    if (window == 0) throw std::invalid_argument("window must hold at least one weight");
+    return std::make_unique<WindowedBlueBox>(initial_weight, window);
+}
+
+// Factory method to create a windowed quantile box with the given initial weight
+std::unique_ptr<Box> Box::makeWindowedQuantileBox(double initial_weight, size_t window, double q) {
+    if (window == 0 || window > std::numeric_limits<uint32_t>::max() - 1) {
+        throw std::invalid_argument("window must hold between one and 2^32 - 2 weights");
+    }
+    if (!(q >= 0.0 && q <= 1.0)) throw std::invalid_argument("quantile must lie in [0, 1]");
+    return std::make_unique<WindowedQuantileBox>(initial_weight, window, q);
+}
+
+/**
+ * Policy deciding which of several boxes tied for the smallest weight absorbs the token.
+ *
+ * Strategies only read box state (weights and Box::previewScore()), so evaluating a
+ * candidate never copies or mutates boxes.
+ */
+class TieBreakStrategy {
+public:
+    virtual ~TieBreakStrategy() = default;
+
+    /**
+     * Returns the index into candidates of the box that absorbs upcoming[0].
+     * upcoming holds the current token followed by the remaining input (count >= 1).
+     */
+    virtual size_t choose(const std::vector<Box*>& candidates,
+        const std::vector<std::unique_ptr<Box> >& boxes,
+        const uint32_t* upcoming, size_t count) const = 0;
+};
+
+/**
+ * Takes the first tied box, as the plain game does.
+ */
+class FirstBoxStrategy : public TieBreakStrategy {
+public:
+    size_t choose(const std::vector<Box*>&, const std::vector<std::unique_ptr<Box> >&,
+        const uint32_t*, size_t) const override {
+        return 0;
+    }
+};
+
+/**
+ * Takes the tied box with the highest immediate score for the current token.
+ */
+class GreedyScoreStrategy : public TieBreakStrategy {
+public:
+    size_t choose(const std::vector<Box*>& candidates, const std::vector<std::unique_ptr<Box> >&,
+        const uint32_t* upcoming, size_t) const override {
+        size_t best = 0;
+        double bestScore = candidates[0]->previewScore(upcoming[0]);
+        for (size_t i = 1; i < candidates.size(); ++i) {
+            double score = candidates[i]->previewScore(upcoming[0]);
+            if (score > bestScore) {
+                bestScore = score;
+                best = i;
+            }
+        }
+        return best;
+    }
+};
+
+/**
+ * Looks k turns beyond the current one: for each tied box, the box weights are advanced
+ * hypothetically (the first lightest box takes each later token) and the candidate is
+ * rated by its own immediate score plus the previewed scores of the own later turns,
+ * minus those of the opponent's turns.
+ *
+ * Previews use each box's current state, so a box hit twice within the horizon is
+ * rated approximately.
+ */
+class LookaheadStrategy : public TieBreakStrategy {
+public:
+    explicit LookaheadStrategy(size_t depth) : depth_(depth) {}
+
+    size_t choose(const std::vector<Box*>& candidates, const std::vector<std::unique_ptr<Box> >& boxes,
+        const uint32_t* upcoming, size_t count) const override {
+        size_t horizon = std::min(count, depth_ + 1);
+        size_t best = 0;
+        double bestValue = -std::numeric_limits<double>::infinity();
+        std::vector<double> weights(boxes.size());  // per call, so one strategy can serve several threads
+        for (size_t c = 0; c < candidates.size(); ++c) {
+            size_t chosen = 0;
+            for (size_t i = 0; i < boxes.size(); ++i) {
+                weights[i] = boxes[i]->getRelativeWeight();
+                if (boxes[i].get() == candidates[c]) chosen = i;
+            }
+            double value = candidates[c]->previewScore(upcoming[0]);
+            weights[chosen] += upcoming[0];
+            for (size_t t = 1; t < horizon; ++t) {
+                size_t next = std::min_element(weights.begin(), weights.end()) - weights.begin();
+                double score = boxes[next]->previewScore(upcoming[t]);
+                value += t % 2 == 0 ? score : -score;
+                weights[next] += upcoming[t];
+            }
+            if (value > bestValue) {
+                bestValue = value;
+                best = c;
+            }
+        }
+        return best;
+    }
+
+private:
+    size_t depth_;
+};
+
+/**
+ * Relative weight of the lightest box above which a turn rebases all boxes. Relative
+ * weights then stay far below 2^49, where doubles still tell the 0.1 offsets apart.
+ */
+const double kRebaseThreshold = 4294967296.0;  // 2^32
+
+/**
+ * Moves the whole part of the lightest relative weight into the offsets of all boxes.
+ */
+void rebaseBoxes(const std::vector<std::unique_ptr<Box> >& boxes, double lightest) {
+    uint64_t amount = static_cast<uint64_t>(lightest);
+    for (auto& box : boxes) {
+        box->rebase(amount);
+    }
+}
+
+/**
+ * Outcome of one turn: the index of the box that absorbed the token and its score.
+ */
+struct TurnRecord {
+    size_t box;
+    double score;
+};
+
 /**
  * Class representing a Player.
  */
 class Player {
 public:
-    void takeTurn(uint32_t input_weight,
+    Player() = default;
+
+    /**
+     * Creates a player resolving ties with the given strategy, which must outlive the player.
+     */
+    explicit Player(const TieBreakStrategy* strategy) : strategy_(strategy) {}
+
+    TurnRecord takeTurn(uint32_t input_weight,
+        const std::vector<std::unique_ptr<Box> >& boxes) {
+        return takeTurn(&input_weight, 1, boxes);
+    }
+
+    /**
+     * Takes a turn with upcoming[0]; the following tokens are only visible to the strategy.
+     */
+    TurnRecord takeTurn(const uint32_t* upcoming, size_t count,
         const std::vector<std::unique_ptr<Box> >& boxes) {
         /**
          * Find the box with the smallest weight
@@ -198,57 +758,4556 @@ public:
                 smallestWeightBox = box.get();
             }
         }
-        score_ += smallestWeightBox->absorb(input_weight);
+        if (smallestWeightBox->getRelativeWeight() >= kRebaseThreshold) {
+            rebaseBoxes(boxes, smallestWeightBox->getRelativeWeight());
+        }
+        if (strategy_ != nullptr) {
+            candidates_.clear();
+            for (auto& box : boxes) {
+                if (!(*smallestWeightBox < *box)) {
+                    candidates_.push_back(box.get());
+                }
+            }
+            if (candidates_.size() > 1) {
+                smallestWeightBox = candidates_[strategy_->choose(candidates_, boxes, upcoming, count)];
+            }
+        }
+        TurnRecord record{ 0, smallestWeightBox->absorb(upcoming[0]) };
+        while (boxes[record.box].get() != smallestWeightBox) ++record.box;
+        score_ += record.score;
+        return record;
     }
 
     double getScore() const { return score_; }
 
 private:
     double score_{ 0.0 };
+    const TieBreakStrategy* strategy_{ nullptr };
+    std::vector<Box*> candidates_;
 };
 
 /**
- * Plays the game with the given input weights.
+ * Creates the standard roster: green boxes 0.0 and 0.1, blue boxes 0.2 and 0.3.
  */
-std::pair<double, double> play(const std::vector<uint32_t>& input_weights) {
+std::vector<std::unique_ptr<Box> > makeStandardBoxes() {
     std::vector<std::unique_ptr<Box> > boxes;
     boxes.emplace_back(Box::makeGreenBox(0.0));
     boxes.emplace_back(Box::makeGreenBox(0.1));
     boxes.emplace_back(Box::makeBlueBox(0.2));
     boxes.emplace_back(Box::makeBlueBox(0.3));
+    return boxes;
+}
+
+/**
+ * Plays the input on the given boxes with the players resolving ties by the given
+ * strategies (nullptr takes the first tied box). Returns the scores of A and B.
+ */
+std::pair<double, double> playWithStrategies(const std::vector<uint32_t>& input_weights,
+    const std::vector<std::unique_ptr<Box> >& boxes,
+    const TieBreakStrategy* strategy_A, const TieBreakStrategy* strategy_B) {
+    Player players[2] = { Player(strategy_A), Player(strategy_B) };
+    for (size_t t = 0; t < input_weights.size(); ++t) {
+        players[t % 2].takeTurn(&input_weights[t], input_weights.size() - t, boxes);
+    }
+    return std::make_pair(players[0].getScore(), players[1].getScore());
+}
+
+/**
+ * Game fingerprints: a rolling hash over every turn's index, box index and exact score
+ * bits, folded in turn order by every engine. Equal games give equal fingerprints across
+ * engines, thread counts and reruns, so two runs compare in O(1) per game. Not
+ * cryptographic. The template serves both scalar values and lane vectors, which keeps
+ * the lane kernel's arithmetic identical to the scalar engines'.
+ */
+const uint64_t kFingerprintSeed = 0xcbf29ce484222325ull;
+
+template <typename Bits>
+inline __attribute__((always_inline)) void foldTurnBits(Bits& fingerprint, const Bits& turn, const Bits& box,
+    const Bits& scoreBits) {
+    Bits h = (fingerprint ^ scoreBits ^ (turn * 0x9e3779b97f4a7c15ull + box)) * 0x100000001b3ull;
+    fingerprint = h ^ (h >> 29);
+}
+
+inline uint64_t foldTurn(uint64_t fingerprint, uint64_t turn, uint64_t box, double score) {
+    foldTurnBits<uint64_t>(fingerprint, turn, box, doubleBits(score));
+    return fingerprint;
+}
+
+/**
+ * Final scores of one game, as produced by every game engine, and the game's fingerprint.
+ * Equality compares the scores only.
+ */
+struct GameResult {
+    double scoreA = 0.0;
+    double scoreB = 0.0;
+    uint64_t fingerprint = kFingerprintSeed;
+};
+
+bool operator==(const GameResult& lhs, const GameResult& rhs) {
+    return lhs.scoreA == rhs.scoreA && lhs.scoreB == rhs.scoreB;
+}
+
+/**
+ * Reference engine: plays the tokens with the Box/Player mechanics on the standard roster.
+ */
+GameResult playReference(const uint32_t* input_weights, size_t count) {
+    std::vector<std::unique_ptr<Box> > boxes = makeStandardBoxes();
 
+    ASAPHUS_PROBE2(game_start, "reference", count);
     Player player_A;
     Player player_B;
+    GameResult result;
     int turn = 0;
-    for (auto weight : input_weights) {
+    for (size_t i = 0; i < count; ++i) {
+        TurnRecord record;
         if (turn == 0) {
-            player_A.takeTurn(weight, boxes);
+            record = player_A.takeTurn(input_weights[i], boxes);
         }
         else {
-            player_B.takeTurn(weight, boxes);
+            record = player_B.takeTurn(input_weights[i], boxes);
         }
+        result.fingerprint = foldTurn(result.fingerprint, i, record.box, record.score);
         turn = (turn + 1) % 2;
     }
 
-    std::cout << "Scores: player A " << player_A.getScore() << ", player B "
-        << player_B.getScore() << std::endl;
-    return std::make_pair(player_A.getScore(), player_B.getScore());
+    result.scoreA = player_A.getScore();
+    result.scoreB = player_B.getScore();
+    ASAPHUS_PROBE3(game_end, "reference", doubleBits(result.scoreA), doubleBits(result.scoreB));
+    return result;
 }
 
-// Test cases
-
-TEST_CASE("Final scores for first 4 Fibonacci numbers", "[fibonacci4]") {
-    std::vector<uint32_t> inputs{ 1, 1, 2, 3 };
-    auto result = play(inputs);
-    REQUIRE(result.first == 13.0);
-    REQUIRE(result.second == 25.0);
+/**
+ * Number of worker threads used when the caller does not ask for a specific count.
+ */
+unsigned defaultThreadCount() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
 }
 
-TEST_CASE("Final scores for first 8 Fibonacci numbers", "[fibonacci8]") {
-    std::vector<uint32_t> inputs{ 1, 1, 2, 3, 5, 8, 13, 21 };
-    auto result = play(inputs);
-    REQUIRE(result.first == 155.0);
-    REQUIRE(result.second == 366.25);
+/**
+ * Splits [0, count) into one contiguous chunk per thread and calls
+ * fn(begin, end, worker) for each chunk. Runs inline for a single thread.
+ * If a thread cannot be started, the ones already running are joined before the
+ * exception propagates.
+ */
+template <typename Fn>
+void parallelChunks(size_t count, unsigned threads, Fn fn) {
+    if (count == 0) return;
+    size_t workers = std::max<size_t>(1, std::min<size_t>(threads, count));
+    if (workers == 1) {
+        fn(size_t(0), count, 0u);
+        return;
+    }
+    size_t chunk = (count + workers - 1) / workers;
+    std::vector<std::thread> pool;
+    try {
+        pool.reserve(workers);
+        for (size_t w = 0; w < workers; ++w) {
+            size_t begin = w * chunk;
+            size_t end = std::min(count, begin + chunk);
+            if (begin >= end) break;
+            pool.emplace_back(fn, begin, end, static_cast<unsigned>(w));
+        }
+    }
+    catch (...) {
+        for (auto& t : pool) {
+            t.join();
+        }
+        throw;
+    }
+    for (auto& t : pool) {
+        t.join();
+    }
+}
+
+/**
+ * Initial weights of the standard roster: two green boxes followed by two blue boxes.
+ */
+const double kStandardInitialWeights[4] = { 0.0, 0.1, 0.2, 0.3 };
+
+/**
+ * Value-type state of the standard four-box game.
+ *
+ * Mirrors the Box/Player mechanics turn for turn (boxes 0 and 1 are green, 2 and 3
+ * are blue), but can be copied, hashed and compared cheaply. Box weights are kept as
+ * the integer token total absorbed on top of the initial weight, so selection is an
+ * exact integer comparison. Totals are relative to `base`, which absorbs their common
+ * minimum whenever one approaches kRebaseLimit, so games of any length stay exact.
+ */
+struct GameState {
+    static const uint64_t kRebaseLimit = uint64_t(1) << 59;  // absorbed * 10 + 3 must fit
+
+    uint64_t absorbed[4] = { 0, 0, 0, 0 };
+    uint64_t base = 0;
+    uint32_t window[2][3] = { { 0, 0, 0 }, { 0, 0, 0 } };  // GreenBox weights, oldest first
+    uint8_t windowSize[2] = { 0, 0 };
+    uint32_t blueMin[2] = { 0, 0 };
+    uint32_t blueMax[2] = { 0, 0 };
+    bool blueSeen[2] = { false, false };
+    double scores[2] = { 0.0, 0.0 };  // player A, player B
+    uint64_t turn = 0;
+    uint64_t fingerprint = kFingerprintSeed;
+
+    /**
+     * Weight of the given box.
+     */
+    double weight(int box) const {
+        return kStandardInitialWeights[box] + static_cast<double>(base + absorbed[box]);
+    }
+
+    /**
+     * Index of the first box with the smallest weight.
+     * Initial weights are tenths, so weight order equals order of absorbed * 10 + index.
+     */
+    int selectBox() const {
+        int best = 0;
+        uint64_t bestKey = absorbed[0] * 10;
+        for (int i = 1; i < 4; ++i) {
+            uint64_t key = absorbed[i] * 10 + i;
+            if (key < bestKey) {
+                bestKey = key;
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    /**
+     * Lets the given box absorb the token and returns the box score.
+     */
+    double absorb(int box, uint32_t token) {
+        absorbed[box] += token;
+        if (absorbed[box] >= kRebaseLimit) normalize();
+        if (box < 2) {
+            uint32_t* w = window[box];
+            if (windowSize[box] == 3) {
+                w[0] = w[1];
+                w[1] = w[2];
+                w[2] = token;
+            }
+            else {
+                w[windowSize[box]++] = token;
+            }
+            double sum = 0;
+            for (int i = 0; i < windowSize[box]; ++i) {
+                sum += w[i];
+            }
+            double m = sum / windowSize[box];
+            return m * m;
+        }
+        int b = box - 2;
+        if (blueSeen[b]) {
+            blueMin[b] = std::min(blueMin[b], token);
+            blueMax[b] = std::max(blueMax[b], token);
+        }
+        else {
+            blueMin[b] = blueMax[b] = token;
+            blueSeen[b] = true;
+        }
+        return cantorPairing(blueMin[b], blueMax[b]);
+    }
+
+    /**
+     * Plays one turn: the current player lets the lightest box absorb the token.
+     * Returns the score credited to that player.
+     */
+    double step(uint32_t token) {
+        int box = selectBox();
+        double score = absorb(box, token);
+        ASAPHUS_PROBE3(turn, turn, box, doubleBits(score));
+        fingerprint = foldTurn(fingerprint, turn, box, score);
+        scores[turn % 2] += score;
+        ++turn;
+        return score;
+    }
+
+    GameResult result() const {
+        GameResult r;
+        r.scoreA = scores[0];
+        r.scoreB = scores[1];
+        r.fingerprint = fingerprint;
+        return r;
+    }
+
+    /**
+     * Moves the common minimum of the absorbed totals into base. Selection and all
+     * future scores only depend on the relative weights.
+     */
+    void normalize() {
+        uint64_t lowest = *std::min_element(absorbed, absorbed + 4);
+        for (auto& a : absorbed) {
+            a -= lowest;
+        }
+        base += lowest;
+    }
+};
+
+const uint64_t GameState::kRebaseLimit;
+
+/**
+ * True if both states have identical boxes (relative weights, windows, min/max), ignoring
+ * scores, turn and base.
+ */
+bool sameBoxes(const GameState& lhs, const GameState& rhs) {
+    return std::equal(lhs.absorbed, lhs.absorbed + 4, rhs.absorbed)
+        && std::equal(&lhs.window[0][0], &lhs.window[0][0] + 6, &rhs.window[0][0])
+        && std::equal(lhs.windowSize, lhs.windowSize + 2, rhs.windowSize)
+        && std::equal(lhs.blueMin, lhs.blueMin + 2, rhs.blueMin)
+        && std::equal(lhs.blueMax, lhs.blueMax + 2, rhs.blueMax)
+        && std::equal(lhs.blueSeen, lhs.blueSeen + 2, rhs.blueSeen);
+}
+
+/**
+ * Hash over the box part of a state, consistent with sameBoxes().
+ */
+uint64_t hashBoxes(const GameState& state) {
+    uint64_t h = 1469598103934665603ull;
+    auto mix = [&h](uint64_t v) {
+        h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+    };
+    for (auto a : state.absorbed) mix(a);
+    for (int g = 0; g < 2; ++g) {
+        mix(state.windowSize[g]);
+        for (auto w : state.window[g]) mix(w);
+    }
+    for (int b = 0; b < 2; ++b) {
+        mix(state.blueSeen[b]);
+        mix(state.blueMin[b]);
+        mix(state.blueMax[b]);
+    }
+    return h;
+}
+
+/**
+ * A token weight together with the probability of drawing it.
+ */
+struct TokenProbability {
+    uint32_t token;
+    double probability;
+};
+
+/**
+ * Result of the exact expected-score computation.
+ * Win probabilities are NaN when they were not requested.
+ */
+struct ExactExpectation {
+    double expectedScoreA = 0.0;
+    double expectedScoreB = 0.0;
+    double winProbabilityA = std::numeric_limits<double>::quiet_NaN();
+    double winProbabilityB = std::numeric_limits<double>::quiet_NaN();
+    double tieProbability = std::numeric_limits<double>::quiet_NaN();
+    size_t peakStates = 0;
+};
+
+/**
+ * Computes the exact expected final scores of a game of the given number of turns
+ * whose tokens are drawn i.i.d. from the given distribution.
+ *
+ * Dynamic program over normalized game states: each turn expands every state by every
+ * token, and states with identical boxes are merged by summing their probabilities.
+ * Expected scores follow from linearity, so scores are not part of the state unless
+ * win probabilities are requested, in which case the score difference is kept as well.
+ * Each turn's expansion is split across threads, which merge into one table afterwards.
+ */
+ExactExpectation computeExactExpectation(const std::vector<TokenProbability>& distribution,
+    unsigned turns, bool trackWins = true, unsigned threads = defaultThreadCount()) {
+    struct Hash {
+        size_t operator()(const GameState& s) const {
+            uint64_t h = hashBoxes(s);
+            uint64_t diff;
+            std::memcpy(&diff, &s.scores[0], sizeof(diff));
+            return static_cast<size_t>(h ^ (diff * 0xff51afd7ed558ccdull));
+        }
+    };
+    struct Equal {
+        bool operator()(const GameState& lhs, const GameState& rhs) const {
+            return sameBoxes(lhs, rhs) && lhs.scores[0] == rhs.scores[0];
+        }
+    };
+    using Layer = std::unordered_map<GameState, double, Hash, Equal>;
+
+    ExactExpectation result;
+    std::vector<std::pair<GameState, double> > current{ { GameState(), 1.0 } };
+    result.peakStates = 1;
+
+    for (unsigned t = 0; t < turns; ++t) {
+        unsigned workers = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, current.size())));
+        std::vector<Layer> partial(workers);
+        std::vector<double> gained(workers, 0.0);
+        parallelChunks(current.size(), workers, [&](size_t begin, size_t end, unsigned worker) {
+            Layer& next = partial[worker];
+            double expected = 0.0;
+            for (size_t i = begin; i < end; ++i) {
+                const GameState& from = current[i].first;
+                double p = current[i].second;
+                for (const auto& tp : distribution) {
+                    GameState s = from;
+                    double score = s.step(tp.token);
+                    expected += p * tp.probability * score;
+                    double diff = trackWins ? s.scores[0] - s.scores[1] : 0.0;
+                    s.scores[0] = diff;
+                    s.scores[1] = 0.0;
+                    s.normalize();
+                    next[s] += p * tp.probability;
+                }
+            }
+            gained[worker] = expected;
+        });
+
+        double expected = 0.0;
+        for (double g : gained) expected += g;
+        (t % 2 == 0 ? result.expectedScoreA : result.expectedScoreB) += expected;
+
+        Layer merged = std::move(partial[0]);
+        for (unsigned w = 1; w < workers; ++w) {
+            for (const auto& entry : partial[w]) {
+                merged[entry.first] += entry.second;
+            }
+        }
+        current.assign(merged.begin(), merged.end());
+        result.peakStates = std::max(result.peakStates, current.size());
+    }
+
+    if (trackWins) {
+        result.winProbabilityA = result.winProbabilityB = result.tieProbability = 0.0;
+        for (const auto& entry : current) {
+            double diff = entry.first.scores[0];
+            (diff > 0 ? result.winProbabilityA : diff < 0 ? result.winProbabilityB : result.tieProbability)
+                += entry.second;
+        }
+    }
+    return result;
+}
+
+/**
+ * Engine over the GameState value type.
+ */
+GameResult playState(const uint32_t* input_weights, size_t count) {
+    ASAPHUS_PROBE2(game_start, "state", count);
+    GameState state;
+    for (size_t i = 0; i < count; ++i) {
+        state.step(input_weights[i]);
+    }
+    GameResult result = state.result();
+    ASAPHUS_PROBE3(game_end, "state", doubleBits(result.scoreA), doubleBits(result.scoreB));
+    return result;
+}
+
+/**
+ * Instruction set variants the vectorized kernels are built for.
+ */
+enum class Isa { Baseline, Sse42, Avx2, Avx512 };
+
+const char* isaName(Isa isa) {
+    switch (isa) {
+    case Isa::Sse42: return "sse4.2";
+    case Isa::Avx2: return "avx2";
+    case Isa::Avx512: return "avx512";
+    default: return "baseline";
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * True if the OS saves all register state in the given XCR0 mask on context switches,
+ * which the CPUID feature bits alone do not tell.
+ */
+bool osSavesState(uint64_t mask) {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE)) return false;
+    uint32_t low, high;
+    __asm__("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    return ((uint64_t(high) << 32 | low) & mask) == mask;
+}
+#endif
+
+/**
+ * True if the running CPU and OS can execute kernels built for the given instruction set.
+ * Every feature named in the variant's target attribute is checked.
+ */
+bool isaSupported(Isa isa) {
+#if defined(__x86_64__) || defined(__i386__)
+    const uint64_t kYmmState = 0x6;    // SSE and AVX registers
+    const uint64_t kZmmState = 0xe6;   // plus opmask and both halves of the ZMM registers
+    __builtin_cpu_init();
+    switch (isa) {
+    case Isa::Sse42: return __builtin_cpu_supports("sse4.2");
+    case Isa::Avx2: return __builtin_cpu_supports("avx2") && osSavesState(kYmmState);
+    case Isa::Avx512:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")
+            && __builtin_cpu_supports("avx512dq") && osSavesState(kZmmState);
+    default: return true;
+    }
+#else
+    return isa == Isa::Baseline;
+#endif
+}
+
+/**
+ * Number of games advanced together by the multi-game lane kernel.
+ */
+const size_t kLanes = 8;
+
+/**
+ * One value per lane, as GCC vector types so that every instruction set variant maps
+ * them onto its widest registers. Element alignment only, so blocks can live on the heap.
+ */
+typedef int64_t LaneInts __attribute__((vector_size(8 * kLanes), aligned(8)));
+typedef double LaneDoubles __attribute__((vector_size(8 * kLanes), aligned(8)));
+typedef uint64_t LaneBits __attribute__((vector_size(8 * kLanes), aligned(8)));
+
+/**
+ * Structure-of-arrays state of kLanes standard games, one game per lane.
+ * Unseen BlueBox min/max are +/- infinity, so absorbing needs no first-token branch.
+ */
+struct LaneBlock {
+    LaneInts absorbed[4];
+    LaneDoubles window[2][3];
+    LaneInts windowSize[2];
+    LaneDoubles blueMin[2];
+    LaneDoubles blueMax[2];
+    LaneDoubles scores[2];
+    LaneDoubles lastScore;  // score of each lane's latest turn
+    LaneInts turn;
+    LaneBits fingerprint;
+
+    LaneBlock() {
+        const double inf = std::numeric_limits<double>::infinity();
+        for (size_t l = 0; l < kLanes; ++l) {
+            for (int i = 0; i < 4; ++i) absorbed[i][l] = 0;
+            for (int g = 0; g < 2; ++g) {
+                window[g][0][l] = window[g][1][l] = window[g][2][l] = 0.0;
+                windowSize[g][l] = 0;
+                blueMin[g][l] = inf;
+                blueMax[g][l] = -inf;
+                scores[g][l] = 0.0;
+            }
+            lastScore[l] = 0.0;
+            turn[l] = 0;
+            fingerprint[l] = kFingerprintSeed;
+        }
+    }
+};
+
+// Kernel bodies, compiled once per instruction set below.
+
+#define ASAPHUS_KERNEL_BODY inline __attribute__((always_inline))
+
+/**
+ * GreenBox scores after each of the tokens absorbed by one box, in order.
+ */
+ASAPHUS_KERNEL_BODY void greenScoresBody(const uint32_t* __restrict tokens, size_t count,
+    double* __restrict scores) {
+    for (size_t i = 0; i < count && i < 2; ++i) {
+        double sum = 0;
+        for (size_t j = 0; j <= i; ++j) sum += tokens[j];
+        double m = sum / (i + 1);
+        scores[i] = m * m;
+    }
+    size_t i = 2;
+    for (; i + kLanes <= count; i += kLanes) {
+        LaneInts oldest, middle, newest;
+        for (size_t l = 0; l < kLanes; ++l) {
+            oldest[l] = tokens[i + l - 2];
+            middle[l] = tokens[i + l - 1];
+            newest[l] = tokens[i + l];
+        }
+        LaneDoubles sum = {};
+        sum += __builtin_convertvector(oldest, LaneDoubles);
+        sum += __builtin_convertvector(middle, LaneDoubles);
+        sum += __builtin_convertvector(newest, LaneDoubles);
+        LaneDoubles m = sum / 3;
+        LaneDoubles square = m * m;
+        std::memcpy(scores + i, &square, sizeof(square));
+    }
+    for (; i < count; ++i) {
+        double sum = 0;
+        sum += tokens[i - 2];
+        sum += tokens[i - 1];
+        sum += tokens[i];
+        double m = sum / 3;
+        scores[i] = m * m;
+    }
+}
+
+/**
+ * BlueBox scores after each of the tokens absorbed by one box, in order.
+ */
+ASAPHUS_KERNEL_BODY void blueScoresBody(const uint32_t* tokens, size_t count, double* scores) {
+    uint32_t lo = count ? tokens[0] : 0, hi = lo;
+    for (size_t i = 0; i < count; ++i) {
+        lo = std::min(lo, tokens[i]);
+        hi = std::max(hi, tokens[i]);
+        scores[i] = cantorPairing(lo, hi);
+    }
+}
+
+/**
+ * GreenBox g absorbs the token in the lanes selected by hit and sets their score.
+ */
+ASAPHUS_KERNEL_BODY void greenLanes(LaneBlock& b, int g, const LaneInts& hit, const LaneDoubles& token,
+    LaneDoubles& score) {
+    const LaneDoubles zero = {};
+    LaneInts n = b.windowSize[g];
+    LaneInts full = n == 3;
+    LaneDoubles w0 = b.window[g][0], w1 = b.window[g][1], w2 = b.window[g][2];
+    LaneDoubles n0 = full ? w1 : (n == 0 ? token : w0);
+    LaneDoubles n1 = full ? w2 : (n == 1 ? token : w1);
+    LaneDoubles n2 = (full | (n == 2)) ? token : w2;
+    LaneInts size = full ? n : n + 1;
+    b.window[g][0] = hit ? n0 : w0;
+    b.window[g][1] = hit ? n1 : w1;
+    b.window[g][2] = hit ? n2 : w2;
+    b.windowSize[g] = hit ? size : n;
+    LaneDoubles sum = zero;
+    sum += n0;
+    sum += size > 1 ? n1 : zero;
+    sum += size > 2 ? n2 : zero;
+    LaneDoubles m = sum / __builtin_convertvector(size, LaneDoubles);
+    score = hit ? m * m : score;
+}
+
+/**
+ * BlueBox c absorbs the token in the lanes selected by hit and sets their score.
+ */
+ASAPHUS_KERNEL_BODY void blueLanes(LaneBlock& b, int c, const LaneInts& hit, const LaneDoubles& token,
+    LaneDoubles& score) {
+    LaneDoubles lo = token < b.blueMin[c] ? token : b.blueMin[c];
+    LaneDoubles hi = token > b.blueMax[c] ? token : b.blueMax[c];
+    b.blueMin[c] = hit ? lo : b.blueMin[c];
+    b.blueMax[c] = hit ? hi : b.blueMax[c];
+    score = hit ? (lo + hi) * (lo + hi + 1) / 2 + hi : score;  // cantorPairing(lo, hi)
+}
+
+/**
+ * Advances every active lane by one turn with its token, branch-free across lanes.
+ */
+ASAPHUS_KERNEL_BODY void stepLanesBody(LaneBlock& b, const uint32_t* tokens, const uint8_t* active) {
+    LaneInts on, token;
+    for (size_t l = 0; l < kLanes; ++l) {
+        on[l] = active[l] ? -1 : 0;
+        token[l] = tokens[l];
+    }
+    token &= on;
+
+    LaneInts k0 = b.absorbed[0] * 10;
+    LaneInts k1 = b.absorbed[1] * 10 + 1;
+    LaneInts k2 = b.absorbed[2] * 10 + 2;
+    LaneInts k3 = b.absorbed[3] * 10 + 3;
+    LaneInts low01 = k1 < k0 ? k1 : k0;
+    LaneInts low23 = k3 < k2 ? k3 : k2;
+    LaneInts sel01 = (k1 < k0) & 1;
+    LaneInts sel23 = 2 + ((k3 < k2) & 1);
+    LaneInts sel = low23 < low01 ? sel23 : sel01;
+
+    LaneDoubles weight = __builtin_convertvector(token, LaneDoubles);
+    LaneDoubles score = {};
+    for (int box = 0; box < 4; ++box) {
+        LaneInts hit = on & (sel == box);
+        b.absorbed[box] += token & (sel == box);
+        if (box < 2) {
+            greenLanes(b, box, hit, weight, score);
+        }
+        else {
+            blueLanes(b, box - 2, hit, weight, score);
+        }
+    }
+
+    LaneInts parity = b.turn & 1;
+    b.scores[0] += (on & (parity == 0)) ? score : LaneDoubles{};
+    b.scores[1] += (on & (parity == 1)) ? score : LaneDoubles{};
+    b.lastScore = score;
+    LaneBits folded = b.fingerprint;
+    foldTurnBits<LaneBits>(folded, (LaneBits)b.turn, (LaneBits)sel, (LaneBits)score);
+    b.fingerprint = on ? folded : b.fingerprint;
+    b.turn -= on;
+}
+
+/**
+ * Widens count tokens stored with the given byte width (1, 2 or 4) into 32-bit tokens.
+ * Fixed-size inner chunks let each variant use its widest zero-extending loads.
+ */
+template <typename Narrow>
+ASAPHUS_KERNEL_BODY void widenChunks(const uint8_t* in, size_t count, uint32_t* __restrict out) {
+    const size_t kChunk = 32;
+    size_t i = 0;
+    for (; i + kChunk <= count; i += kChunk) {
+        Narrow chunk[kChunk];
+        std::memcpy(chunk, in + i * sizeof(Narrow), sizeof(chunk));
+        for (size_t j = 0; j < kChunk; ++j) out[i + j] = chunk[j];
+    }
+    for (; i < count; ++i) {
+        Narrow value;
+        std::memcpy(&value, in + i * sizeof(Narrow), sizeof(Narrow));
+        out[i] = value;
+    }
+}
+
+ASAPHUS_KERNEL_BODY void widenTokensBody(const uint8_t* in, size_t width, size_t count, uint32_t* out) {
+    switch (width) {
+    case 1: widenChunks<uint8_t>(in, count, out); break;
+    case 2: widenChunks<uint16_t>(in, count, out); break;
+    default: std::memcpy(out, in, count * sizeof(uint32_t)); break;
+    }
+}
+
+/**
+ * Clears mask[i] unless low <= values[i] <= high. Masks are bytes so that one mask
+ * serves columns of every width; fixed-size inner chunks get the loop vectorized.
+ */
+template <typename T>
+ASAPHUS_KERNEL_BODY void filterRangeBody(const T* __restrict values, size_t count, T low, T high,
+    uint8_t* __restrict mask) {
+    const size_t kChunk = 32;
+    size_t i = 0;
+    for (; i + kChunk <= count; i += kChunk) {
+        for (size_t j = 0; j < kChunk; ++j) {
+            mask[i + j] &= static_cast<uint8_t>((values[i + j] >= low) & (values[i + j] <= high));
+        }
+    }
+    for (; i < count; ++i) {
+        mask[i] &= static_cast<uint8_t>((values[i] >= low) & (values[i] <= high));
+    }
+}
+
+/**
+ * Dispatch table of the vectorized kernels for one instruction set.
+ */
+struct SimdKernels {
+    Isa isa;
+    void (*greenScores)(const uint32_t* tokens, size_t count, double* scores);
+    void (*blueScores)(const uint32_t* tokens, size_t count, double* scores);
+    void (*stepLanes)(LaneBlock& block, const uint32_t* tokens, const uint8_t* active);
+    void (*widenTokens)(const uint8_t* in, size_t width, size_t count, uint32_t* out);
+    void (*filterDoubles)(const double* values, size_t count, double low, double high, uint8_t* mask);
+    void (*filterUint64s)(const uint64_t* values, size_t count, uint64_t low, uint64_t high, uint8_t* mask);
+    void (*filterUint32s)(const uint32_t* values, size_t count, uint32_t low, uint32_t high, uint8_t* mask);
+};
+
+#define ASAPHUS_DEFINE_KERNELS(suffix, isa, target)                                               \
+    target void greenScores_##suffix(const uint32_t* t, size_t n, double* s) {                    \
+        greenScoresBody(t, n, s);                                                                 \
+    }                                                                                             \
+    target void blueScores_##suffix(const uint32_t* t, size_t n, double* s) {                     \
+        blueScoresBody(t, n, s);                                                                  \
+    }                                                                                             \
+    target void stepLanes_##suffix(LaneBlock& b, const uint32_t* t, const uint8_t* a) {           \
+        stepLanesBody(b, t, a);                                                                   \
+    }                                                                                             \
+    target void widenTokens_##suffix(const uint8_t* in, size_t w, size_t n, uint32_t* out) {      \
+        widenTokensBody(in, w, n, out);                                                           \
+    }                                                                                             \
+    target void filterDoubles_##suffix(const double* v, size_t n, double lo, double hi,           \
+        uint8_t* m) {                                                                             \
+        filterRangeBody(v, n, lo, hi, m);                                                         \
+    }                                                                                             \
+    target void filterUint64s_##suffix(const uint64_t* v, size_t n, uint64_t lo, uint64_t hi,     \
+        uint8_t* m) {                                                                             \
+        filterRangeBody(v, n, lo, hi, m);                                                         \
+    }                                                                                             \
+    target void filterUint32s_##suffix(const uint32_t* v, size_t n, uint32_t lo, uint32_t hi,     \
+        uint8_t* m) {                                                                             \
+        filterRangeBody(v, n, lo, hi, m);                                                         \
+    }                                                                                             \
+    const SimdKernels kKernels_##suffix = { isa, greenScores_##suffix, blueScores_##suffix,       \
+        stepLanes_##suffix, widenTokens_##suffix, filterDoubles_##suffix, filterUint64s_##suffix, \
+        filterUint32s_##suffix };
+
+ASAPHUS_DEFINE_KERNELS(baseline, Isa::Baseline, )
+#if defined(__x86_64__) || defined(__i386__)
+ASAPHUS_DEFINE_KERNELS(sse42, Isa::Sse42, __attribute__((target("sse4.2"))))
+ASAPHUS_DEFINE_KERNELS(avx2, Isa::Avx2, __attribute__((target("avx2"))))
+ASAPHUS_DEFINE_KERNELS(avx512, Isa::Avx512, __attribute__((target("avx512f,avx512vl,avx512dq"))))
+#endif
+
+/**
+ * Kernels built for the given instruction set, or nullptr if the CPU cannot run them.
+ */
+const SimdKernels* simdKernelsFor(Isa isa) {
+    if (!isaSupported(isa)) return nullptr;
+#if defined(__x86_64__) || defined(__i386__)
+    switch (isa) {
+    case Isa::Sse42: return &kKernels_sse42;
+    case Isa::Avx2: return &kKernels_avx2;
+    case Isa::Avx512: return &kKernels_avx512;
+    default: break;
+    }
+#endif
+    return &kKernels_baseline;
+}
+
+/**
+ * Best kernels for this CPU, unless ASAPHUS_FORCE_ISA names a supported variant
+ * ("baseline", "sse4.2", "avx2", "avx512").
+ */
+const SimdKernels* detectSimdKernels() {
+    const Isa all[] = { Isa::Avx512, Isa::Avx2, Isa::Sse42, Isa::Baseline };
+    const char* forced = std::getenv("ASAPHUS_FORCE_ISA");
+    if (forced != nullptr) {
+        for (Isa isa : all) {
+            if (std::strcmp(forced, isaName(isa)) == 0 && simdKernelsFor(isa) != nullptr) {
+                return simdKernelsFor(isa);
+            }
+        }
+        std::cerr << "ASAPHUS_FORCE_ISA=" << forced << " is not available, using CPU detection" << std::endl;
+    }
+    for (Isa isa : all) {
+        if (simdKernelsFor(isa) != nullptr) return simdKernelsFor(isa);
+    }
+    return &kKernels_baseline;
+}
+
+std::atomic<const SimdKernels*> g_simdKernels{ detectSimdKernels() };
+
+/**
+ * Kernels selected at startup.
+ */
+const SimdKernels& simdKernels() {
+    return *g_simdKernels.load(std::memory_order_relaxed);
+}
+
+/**
+ * Forces the kernels of the given instruction set, e.g. to test each variant on one machine.
+ * Returns false (and keeps the current kernels) if the CPU cannot run them.
+ */
+bool forceIsa(Isa isa) {
+    const SimdKernels* kernels = simdKernelsFor(isa);
+    if (kernels == nullptr) return false;
+    g_simdKernels.store(kernels);
+    return true;
+}
+
+/**
+ * Two-phase engine: first assigns every token to its box, which only needs the weights,
+ * then computes each box's scores with the per-box scan kernels and credits them in turn order.
+ */
+GameResult playTwoPhase(const uint32_t* input_weights, size_t count) {
+    ASAPHUS_PROBE2(game_start, "two-phase", count);
+    std::vector<uint8_t> assignment(count);
+    std::vector<uint32_t> perBox[4];
+    GameState state;
+    for (size_t t = 0; t < count; ++t) {
+        int box = state.selectBox();
+        state.absorbed[box] += input_weights[t];
+        if (state.absorbed[box] >= GameState::kRebaseLimit) state.normalize();
+        assignment[t] = static_cast<uint8_t>(box);
+        perBox[box].push_back(input_weights[t]);
+    }
+
+    const SimdKernels& kernels = simdKernels();
+    std::vector<double> boxScores[4];
+    for (int box = 0; box < 4; ++box) {
+        boxScores[box].resize(perBox[box].size());
+        (box < 2 ? kernels.greenScores : kernels.blueScores)(
+            perBox[box].data(), perBox[box].size(), boxScores[box].data());
+    }
+
+    double scores[2] = { 0.0, 0.0 };
+    size_t next[4] = { 0, 0, 0, 0 };
+    GameResult result;
+    for (size_t t = 0; t < count; ++t) {
+        int box = assignment[t];
+        double score = boxScores[box][next[box]++];
+        ASAPHUS_PROBE3(turn, t, box, doubleBits(score));
+        result.fingerprint = foldTurn(result.fingerprint, t, box, score);
+        scores[t % 2] += score;
+    }
+    result.scoreA = scores[0];
+    result.scoreB = scores[1];
+    ASAPHUS_PROBE3(game_end, "two-phase", doubleBits(result.scoreA), doubleBits(result.scoreB));
+    return result;
+}
+
+/**
+ * Subtracts each lane's common minimum from its absorbed totals. Called every
+ * kLaneRebaseInterval turns, so absorbed * 10 never overflows the int64 lanes.
+ */
+const size_t kLaneRebaseInterval = size_t(1) << 20;
+
+void rebaseLanes(LaneBlock& block) {
+    for (size_t l = 0; l < kLanes; ++l) {
+        int64_t lowest = std::min(std::min(block.absorbed[0][l], block.absorbed[1][l]),
+            std::min(block.absorbed[2][l], block.absorbed[3][l]));
+        for (int box = 0; box < 4; ++box) block.absorbed[box][l] -= lowest;
+    }
+}
+
+/**
+ * Multi-game lane engine: advances up to kLanes games in lockstep with the lane kernel.
+ */
+void playLaneGames(const std::vector<uint32_t>* games, size_t count, GameResult* results) {
+    const SimdKernels& kernels = simdKernels();
+    for (size_t first = 0; first < count; first += kLanes) {
+        size_t lanes = std::min(kLanes, count - first);
+        size_t longest = 0;
+        for (size_t l = 0; l < lanes; ++l) {
+            longest = std::max(longest, games[first + l].size());
+            ASAPHUS_PROBE2(game_start, "lanes", games[first + l].size());
+        }
+
+        LaneBlock block;
+        uint32_t tokens[kLanes] = {};
+        uint8_t active[kLanes] = {};
+        for (size_t t = 0; t < longest; ++t) {
+            for (size_t l = 0; l < lanes; ++l) {
+                active[l] = t < games[first + l].size();
+                tokens[l] = active[l] ? games[first + l][t] : 0;
+            }
+            kernels.stepLanes(block, tokens, active);
+            if ((t + 1) % kLaneRebaseInterval == 0) rebaseLanes(block);
+        }
+        for (size_t l = 0; l < lanes; ++l) {
+            results[first + l].scoreA = block.scores[0][l];
+            results[first + l].scoreB = block.scores[1][l];
+            results[first + l].fingerprint = block.fingerprint[l];
+            ASAPHUS_PROBE3(game_end, "lanes", doubleBits(block.scores[0][l]), doubleBits(block.scores[1][l]));
+        }
+    }
+}
+
+/**
+ * Single game on the lane kernel; the lane engine pays off in batches.
+ */
+GameResult playLanes(const uint32_t* input_weights, size_t count) {
+    std::vector<uint32_t> game(input_weights, input_weights + count);
+    GameResult result;
+    playLaneGames(&game, 1, &result);
+    return result;
+}
+
+/**
+ * Token sequence stored in blocks of kBlockSize tokens, each block with the narrowest
+ * width (8, 16 or 32 bits) that holds its largest token.
+ *
+ * The last block stays open until it fills: its tokens are kept at 32 bits and only
+ * encoded once the block is complete, so appending never decodes a block again.
+ */
+class NarrowTokens {
+public:
+    static const size_t kBlockSize = 4096;
+
+    NarrowTokens() = default;
+
+    explicit NarrowTokens(const std::vector<uint32_t>& tokens) {
+        append(tokens.data(), tokens.size());
+    }
+
+    /**
+     * Appends tokens, encoding each block as soon as it is complete.
+     */
+    void append(const uint32_t* tokens, size_t count) {
+        while (count > 0) {
+            size_t take = std::min(count, kBlockSize - open_.size());
+            if (take == kBlockSize) {
+                encode(tokens, take);  // whole block, no need to stage it
+            }
+            else {
+                open_.insert(open_.end(), tokens, tokens + take);
+                openLargest_ = std::max(openLargest_, *std::max_element(tokens, tokens + take));
+                if (open_.size() == kBlockSize) {
+                    encode(open_.data(), kBlockSize);
+                    std::vector<uint32_t>().swap(open_);
+                    openLargest_ = 0;
+                }
+            }
+            tokens += take;
+            count -= take;
+        }
+    }
+
+    size_t size() const { return size_ + open_.size(); }
+
+    size_t blockCount() const { return blocks_.size() + (open_.empty() ? 0 : 1); }
+
+    /**
+     * Bytes per token of the given block; for the open block, the width it will be encoded with.
+     */
+    size_t blockWidth(size_t block) const {
+        return block < blocks_.size() ? blocks_[block].width : widthFor(openLargest_);
+    }
+
+    /**
+     * Bytes of token storage once encoded, excluding the block index.
+     */
+    size_t bytes() const { return data_.size() + open_.size() * widthFor(openLargest_); }
+
+    /**
+     * Widens the given block into out, which must hold kBlockSize tokens.
+     * Returns the number of tokens in the block.
+     */
+    size_t decode(size_t block, uint32_t* out) const {
+        if (block == blocks_.size()) {
+            std::copy(open_.begin(), open_.end(), out);
+            return open_.size();
+        }
+        const Block& b = blocks_[block];
+        simdKernels().widenTokens(data_.data() + b.offset, b.width, b.count, out);
+        return b.count;
+    }
+
+    uint32_t operator[](size_t index) const {
+        if (index / kBlockSize == blocks_.size()) return open_[index % kBlockSize];
+        const Block& b = blocks_[index / kBlockSize];
+        const uint8_t* p = data_.data() + b.offset + (index % kBlockSize) * b.width;
+        uint32_t value = 0;
+        std::memcpy(&value, p, b.width);  // little endian
+        return value;
+    }
+
+private:
+    struct Block {
+        size_t offset;
+        uint32_t count;
+        uint8_t width;
+    };
+
+    static uint8_t widthFor(uint32_t largest) {
+        return largest <= 0xff ? 1 : largest <= 0xffff ? 2 : 4;
+    }
+
+    void encode(const uint32_t* tokens, size_t count) {
+        uint32_t largest = count ? *std::max_element(tokens, tokens + count) : 0;
+        Block b{ data_.size(), static_cast<uint32_t>(count), widthFor(largest) };
+        data_.resize(b.offset + count * b.width);
+        uint8_t* out = data_.data() + b.offset;
+        for (size_t i = 0; i < count; ++i) {
+            std::memcpy(out + i * b.width, &tokens[i], b.width);  // little endian
+        }
+        blocks_.push_back(b);
+        size_ += count;
+    }
+
+    std::vector<uint8_t> data_;
+    std::vector<Block> blocks_;   // complete blocks
+    size_t size_ = 0;             // tokens in complete blocks
+    std::vector<uint32_t> open_;  // tokens of the open last block, fewer than kBlockSize
+    uint32_t openLargest_ = 0;
+};
+
+const size_t NarrowTokens::kBlockSize;
+
+/**
+ * Engine over narrow tokens: widens one block at a time into a cache-resident buffer.
+ */
+GameResult playNarrow(const NarrowTokens& tokens) {
+    uint32_t buffer[NarrowTokens::kBlockSize];
+    GameState state;
+    for (size_t block = 0; block < tokens.blockCount(); ++block) {
+        size_t count = tokens.decode(block, buffer);
+        for (size_t i = 0; i < count; ++i) {
+            state.step(buffer[i]);
+        }
+    }
+    return state.result();
+}
+
+/**
+ * Plays every narrow-token game on up to the given number of threads.
+ */
+std::vector<GameResult> playNarrowBatch(const std::vector<NarrowTokens>& games,
+    unsigned threads = defaultThreadCount()) {
+    std::vector<GameResult> results(games.size());
+    parallelChunks(games.size(), threads, [&](size_t begin, size_t end, unsigned) {
+        for (size_t g = begin; g < end; ++g) {
+            results[g] = playNarrow(games[g]);
+        }
+    });
+    return results;
+}
+
+/**
+ * A named implementation of the game. All engines produce bit-identical scores.
+ */
+struct GameEngine {
+    const char* name;
+    GameResult (*play)(const uint32_t* input_weights, size_t count);
+    // Optional: plays several games at once, used by batches instead of play()
+    void (*playGames)(const std::vector<uint32_t>* games, size_t count, GameResult* results);
+};
+
+/**
+ * All available engines; the first one is the reference.
+ */
+const std::vector<GameEngine>& gameEngines() {
+    static const std::vector<GameEngine> engines{
+        { "reference", playReference, nullptr },
+        { "state", playState, nullptr },
+        { "two-phase", playTwoPhase, nullptr },
+        { "lanes", playLanes, playLaneGames },
+    };
+    return engines;
+}
+
+/**
+ * Looks up an engine by name, returns nullptr if there is none.
+ */
+const GameEngine* findEngine(const std::string& name) {
+    for (const auto& engine : gameEngines()) {
+        if (name == engine.name) return &engine;
+    }
+    return nullptr;
+}
+
+/**
+ * Plays every game with the given engine on up to the given number of threads.
+ * Workers pull small chunks of games from a shared counter, so uneven game
+ * lengths still balance.
+ */
+std::vector<GameResult> playBatch(const std::vector<std::vector<uint32_t> >& games,
+    const GameEngine& engine, unsigned threads = defaultThreadCount()) {
+    const size_t kChunk = 16;
+    std::vector<GameResult> results(games.size());
+    std::atomic<size_t> next{ 0 };
+    size_t chunks = (games.size() + kChunk - 1) / kChunk;
+    parallelChunks(chunks, threads, [&](size_t, size_t, unsigned worker) {
+        for (size_t begin = next.fetch_add(kChunk); begin < games.size(); begin = next.fetch_add(kChunk)) {
+            size_t end = std::min(games.size(), begin + kChunk);
+            ASAPHUS_PROBE3(batch_chunk_start, worker, begin, end);
+            if (engine.playGames != nullptr) {
+                engine.playGames(&games[begin], end - begin, &results[begin]);
+            }
+            else {
+                for (size_t g = begin; g < end; ++g) {
+                    results[g] = engine.play(games[g].data(), games[g].size());
+                }
+            }
+            ASAPHUS_PROBE3(batch_chunk_end, worker, begin, end);
+        }
+    });
+    return results;
+}
+
+/**
+ * Model name of the CPU as reported by /proc/cpuinfo, "unknown" elsewhere.
+ */
+std::string cpuModelName() {
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0) {
+            size_t colon = line.find(':');
+            if (colon != std::string::npos) {
+                return line.substr(line.find_first_not_of(' ', colon + 1));
+            }
+        }
+    }
+    return "unknown";
+}
+
+/**
+ * Picks the fastest engine (and, for batches, thread count) per input size.
+ *
+ * On first use the autotuner times short micro-runs of every engine for a few input
+ * lengths and stores the decision table in a text file keyed by CPU model, core count
+ * and the registered engines. Later processes on the same kind of machine with the
+ * same engines load the table instead of calibrating again. An empty cache path
+ * calibrates in every process.
+ */
+class Autotuner {
+public:
+    /**
+     * Decision for inputs up to maxLength tokens (per game for batches).
+     */
+    struct Decision {
+        size_t maxLength;
+        const GameEngine* engine;
+        unsigned threads;
+    };
+
+    explicit Autotuner(std::string cache_path) : cachePath_(std::move(cache_path)) {}
+
+    /**
+     * Process-wide autotuner, caching in $ASAPHUS_AUTOTUNE_CACHE, or else in
+     * asaphus_autotune.txt under $XDG_CACHE_HOME or ~/.cache. Without either
+     * variable it does not cache.
+     */
+    static Autotuner& instance() {
+        static Autotuner tuner(defaultCachePath());
+        return tuner;
+    }
+
+    GameResult play(const std::vector<uint32_t>& input_weights) {
+        return engineFor(input_weights.size()).play(input_weights.data(), input_weights.size());
+    }
+
+    std::vector<GameResult> playBatch(const std::vector<std::vector<uint32_t> >& games) {
+        size_t tokens = 0;
+        for (const auto& g : games) tokens += g.size();
+        const Decision& d = lookup(batch_, games.empty() ? 0 : tokens / games.size());
+        return ::playBatch(games, *d.engine, d.threads);
+    }
+
+    const GameEngine& engineFor(size_t length) {
+        return *lookup(single_, length).engine;
+    }
+
+    unsigned batchThreadsFor(size_t length) {
+        return lookup(batch_, length).threads;
+    }
+
+    /**
+     * True if this instance ran the micro-benchmarks instead of loading the cache.
+     */
+    bool calibrated() {
+        ensureReady();
+        return calibrated_;
+    }
+
+    /**
+     * Key identifying the machine the decision table is valid for.
+     */
+    static std::string machineKey() {
+        return cpuModelName() + " x" + std::to_string(defaultThreadCount());
+    }
+
+    /**
+     * Names of the registered engines, which the decision table was chosen among.
+     */
+    static std::string enginesKey() {
+        std::string key;
+        for (const auto& engine : gameEngines()) key += std::string(key.empty() ? "" : " ") + engine.name;
+        return key;
+    }
+
+private:
+    static std::string defaultCachePath() {
+        const char* path = std::getenv("ASAPHUS_AUTOTUNE_CACHE");
+        if (path != nullptr) return path;
+        std::string directory;
+        if (const char* cache = std::getenv("XDG_CACHE_HOME")) {
+            directory = cache;
+        }
+        else if (const char* home = std::getenv("HOME")) {
+            directory = std::string(home) + "/.cache";
+        }
+        else {
+            return "";
+        }
+        ::mkdir(directory.c_str(), 0700);  // usually exists already
+        return directory + "/asaphus_autotune.txt";
+    }
+
+    const Decision& lookup(const std::vector<Decision>& table, size_t length) {
+        ensureReady();
+        for (const auto& d : table) {
+            if (length <= d.maxLength) return d;
+        }
+        return table.back();
+    }
+
+    void ensureReady() {
+        std::call_once(ready_, [this] {
+            if (!load()) {
+                calibrate();
+                save();
+                calibrated_ = true;
+            }
+        });
+    }
+
+    bool load() {
+        if (cachePath_.empty()) return false;
+        std::ifstream in(cachePath_);
+        std::string header, key, engines;
+        if (!std::getline(in, header) || header != "asaphus-autotune 2") return false;
+        if (!std::getline(in, key) || key != "machine " + machineKey()) return false;
+        if (!std::getline(in, engines) || engines != "engines " + enginesKey()) return false;
+        std::string kind, name;
+        Decision d;
+        while (in >> kind >> d.maxLength >> name >> d.threads) {
+            d.engine = findEngine(name);
+            if (d.engine == nullptr || d.threads == 0 || (kind != "single" && kind != "batch")) return false;
+            (kind == "single" ? single_ : batch_).push_back(d);
+        }
+        // A complete table ends cleanly and covers every length in both kinds
+        auto complete = [](const std::vector<Decision>& table) {
+            return !table.empty() && table.back().maxLength == std::numeric_limits<size_t>::max();
+        };
+        if (!in.eof() || !complete(single_) || !complete(batch_)) {
+            single_.clear();
+            batch_.clear();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Writes the table to a temporary file and renames it over the cache, so concurrent
+     * processes only ever see a complete table.
+     */
+    void save() const {
+        if (cachePath_.empty()) return;
+        std::string temporary = cachePath_ + ".tmp" + std::to_string(::getpid());
+        {
+            std::ofstream out(temporary, std::ios::trunc);
+            out << "asaphus-autotune 2\n" << "machine " << machineKey() << "\n" << "engines " << enginesKey() << "\n";
+            for (const auto& d : single_) {
+                out << "single " << d.maxLength << " " << d.engine->name << " " << d.threads << "\n";
+            }
+            for (const auto& d : batch_) {
+                out << "batch " << d.maxLength << " " << d.engine->name << " " << d.threads << "\n";
+            }
+            if (!out) {
+                std::remove(temporary.c_str());
+                return;  // the cache is an optimization; the next process calibrates again
+            }
+        }
+        if (std::rename(temporary.c_str(), cachePath_.c_str()) != 0) std::remove(temporary.c_str());
+    }
+
+    template <typename Fn>
+    static double bestSeconds(Fn fn) {
+        double best = std::numeric_limits<double>::infinity();
+        for (int repeat = 0; repeat < 3; ++repeat) {
+            auto start = std::chrono::steady_clock::now();
+            fn();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min(best, elapsed.count());
+        }
+        return best;
+    }
+
+    void calibrate() {
+        std::mt19937 rng(12345);
+        std::uniform_int_distribution<uint32_t> dist(0, 1000);
+        single_.clear();
+        batch_.clear();
+
+        for (size_t length : { size_t(64), size_t(4096), std::numeric_limits<size_t>::max() }) {
+            size_t sample = std::min<size_t>(length, 1 << 16);
+            std::vector<uint32_t> tokens(sample);
+            for (auto& t : tokens) t = dist(rng);
+            Decision best{ length, nullptr, 1 };
+            double bestTime = std::numeric_limits<double>::infinity();
+            for (const auto& engine : gameEngines()) {
+                double time = bestSeconds([&] {
+                    for (size_t done = 0; done < (1 << 16); done += sample) {
+                        engine.play(tokens.data(), tokens.size());
+                    }
+                });
+                if (time < bestTime) {
+                    bestTime = time;
+                    best.engine = &engine;
+                }
+            }
+            single_.push_back(best);
+
+            size_t gameLength = std::min<size_t>(sample, 4096);
+            std::vector<std::vector<uint32_t> > games(std::max<size_t>(64, (1 << 18) / gameLength),
+                std::vector<uint32_t>(tokens.begin(), tokens.begin() + gameLength));
+            Decision bestBatch{ length, nullptr, 1 };
+            bestTime = std::numeric_limits<double>::infinity();
+            for (const auto& engine : gameEngines()) {
+                std::vector<unsigned> counts;
+                for (unsigned threads = 1; threads < defaultThreadCount(); threads *= 2) counts.push_back(threads);
+                counts.push_back(defaultThreadCount());  // e.g. 6 or 12 cores are not a power of two
+                for (unsigned threads : counts) {
+                    double time = bestSeconds([&] { ::playBatch(games, engine, threads); });
+                    if (time < bestTime) {
+                        bestTime = time;
+                        bestBatch.engine = &engine;
+                        bestBatch.threads = threads;
+                    }
+                }
+            }
+            batch_.push_back(bestBatch);
+        }
+    }
+
+    std::string cachePath_;
+    std::once_flag ready_;
+    bool calibrated_ = false;
+    std::vector<Decision> single_;
+    std::vector<Decision> batch_;
+};
+
+/**
+ * Plays the game with the given input weights on the reference engine, or on the
+ * engine the autotuner picks for its length if ASAPHUS_AUTOTUNE=1 opts into tuning.
+ */
+std::pair<double, double> play(const std::vector<uint32_t>& input_weights) {
+    const char* tune = std::getenv("ASAPHUS_AUTOTUNE");
+    GameResult result = tune != nullptr && std::strcmp(tune, "1") == 0
+        ? Autotuner::instance().play(input_weights)
+        : playReference(input_weights.data(), input_weights.size());
+    std::cout << "Scores: player A " << result.scoreA << ", player B "
+        << result.scoreB << std::endl;
+    return std::make_pair(result.scoreA, result.scoreB);
+}
+
+/**
+ * How a buffer from allocateHugePages() is backed.
+ */
+enum class PageBacking { HugeTlb, TransparentHuge, Normal };
+
+const size_t kHugePageSize = size_t(2) << 20;
+
+/**
+ * Counts of buffers handed out per backing, for benchmarks and diagnostics.
+ */
+struct HugePageStats {
+    std::atomic<uint64_t> hugeTlb{ 0 };
+    std::atomic<uint64_t> transparentHuge{ 0 };
+    std::atomic<uint64_t> normal{ 0 };
+};
+
+HugePageStats& hugePageStats() {
+    static HugePageStats stats;
+    return stats;
+}
+
+/**
+ * Maps a buffer of at least the given size on 2 MB pages: explicit huge pages
+ * (MAP_HUGETLB) if the system has them reserved, else a 2 MB aligned mapping with
+ * madvise(MADV_HUGEPAGE) for transparent huge pages, which the kernel may still back
+ * with normal pages. Throws std::bad_alloc if no memory can be mapped.
+ */
+void* allocateHugePages(size_t bytes, PageBacking& backing) {
+    // Rounding up and the alignment slack below must not wrap around
+    if (bytes > std::numeric_limits<size_t>::max() - 2 * kHugePageSize) throw std::bad_alloc();
+    size_t size = (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        backing = PageBacking::HugeTlb;
+        ++hugePageStats().hugeTlb;
+        return p;
+    }
+    // Over-map by one huge page and trim, so the buffer starts on a 2 MB boundary
+    void* raw = mmap(nullptr, size + kHugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) throw std::bad_alloc();
+    uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+    uintptr_t aligned = (start + kHugePageSize - 1) & ~(uintptr_t(kHugePageSize) - 1);
+    if (aligned > start) munmap(raw, aligned - start);
+    size_t tail = (start + size + kHugePageSize) - (aligned + size);
+    if (tail > 0) munmap(reinterpret_cast<void*>(aligned + size), tail);
+    p = reinterpret_cast<void*>(aligned);
+    if (madvise(p, size, MADV_HUGEPAGE) == 0) {
+        backing = PageBacking::TransparentHuge;
+        ++hugePageStats().transparentHuge;
+    }
+    else {
+        backing = PageBacking::Normal;
+        ++hugePageStats().normal;
+    }
+    return p;
+}
+
+/**
+ * Releases a buffer from allocateHugePages() of the same requested size.
+ */
+void freeHugePages(void* p, size_t bytes) {
+    size_t size = (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+    munmap(p, size);
+}
+
+/**
+ * Standard allocator placing large buffers (token streams, game histories) on huge
+ * pages to cut TLB misses of long sequential passes. Buffers below half a huge page
+ * come from operator new, since rounding them up would waste most of the page.
+ */
+template <typename T>
+class HugePageAllocator {
+public:
+    using value_type = T;
+
+    HugePageAllocator() = default;
+
+    template <typename U>
+    HugePageAllocator(const HugePageAllocator<U>&) {}
+
+    /**
+     * Largest element count whose byte size, rounded up to whole huge pages, fits a size_t.
+     */
+    size_t max_size() const { return (std::numeric_limits<size_t>::max() - 2 * kHugePageSize) / sizeof(T); }
+
+    /**
+     * Throws std::bad_array_new_length if n exceeds max_size(), so n * sizeof(T) cannot wrap.
+     */
+    T* allocate(size_t n) {
+        if (n > max_size()) throw std::bad_array_new_length();
+        size_t bytes = n * sizeof(T);
+        if (bytes < kHugePageSize / 2) {
+            return static_cast<T*>(::operator new(bytes));
+        }
+        PageBacking backing;
+        return static_cast<T*>(allocateHugePages(bytes, backing));
+    }
+
+    void deallocate(T* p, size_t n) {
+        assert(n <= max_size() && "not a count from allocate()");
+        size_t bytes = n * sizeof(T);
+        if (bytes < kHugePageSize / 2) {
+            ::operator delete(p);
+        }
+        else {
+            freeHugePages(p, bytes);
+        }
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return false; }
+
+/**
+ * Token stream on huge pages; play it with any engine through data() and size().
+ */
+using HugeTokenVector = std::vector<uint32_t, HugePageAllocator<uint32_t> >;
+
+/**
+ * Indexed replay of a game for inspecting the state at arbitrary turns.
+ *
+ * Playing the game stores a GameState checkpoint every checkpoint_interval turns;
+ * stateAt(t) restores the checkpoint at or before t and replays fewer than
+ * checkpoint_interval turns. Larger intervals use less memory, smaller ones answer faster.
+ */
+class IndexedReplay {
+public:
+    IndexedReplay(std::vector<uint32_t> input_weights, size_t checkpoint_interval)
+        : tokens_(std::move(input_weights)), interval_(std::max<size_t>(1, checkpoint_interval)) {
+        GameState state;
+        checkpoints_.reserve(tokens_.size() / interval_ + 1);
+        for (size_t t = 0; t < tokens_.size(); ++t) {
+            if (t % interval_ == 0) checkpoints_.push_back(state);
+            state.step(tokens_[t]);
+        }
+        if (tokens_.size() % interval_ == 0) checkpoints_.push_back(state);
+        final_ = state;
+    }
+
+    /**
+     * Checkpoint interval that keeps the checkpoints of a game of the given length within max_bytes.
+     */
+    static size_t intervalForBudget(size_t turns, size_t max_bytes) {
+        size_t affordable = std::max<size_t>(1, max_bytes / sizeof(GameState));
+        return std::max<size_t>(1, (turns + affordable - 1) / affordable);
+    }
+
+    /**
+     * State after the first turn tokens have been played, 0 <= turn <= size().
+     */
+    GameState stateAt(size_t turn) const {
+        if (turn > tokens_.size()) {
+            throw std::out_of_range("turn " + std::to_string(turn) + " is beyond the end of the game");
+        }
+        if (turn == tokens_.size()) return final_;
+        GameState state = checkpoints_[turn / interval_];
+        for (size_t t = state.turn; t < turn; ++t) {
+            state.step(tokens_[t]);
+        }
+        return state;
+    }
+
+    const GameState& finalState() const { return final_; }
+
+    size_t size() const { return tokens_.size(); }
+
+    size_t checkpointInterval() const { return interval_; }
+
+    size_t checkpointBytes() const { return checkpoints_.size() * sizeof(GameState); }
+
+private:
+    std::vector<uint32_t> tokens_;
+    size_t interval_;
+    std::vector<GameState, HugePageAllocator<GameState> > checkpoints_;
+    GameState final_;
+};
+
+/**
+ * Kind and initial weight of one box of a custom roster.
+ */
+enum class BoxKind { Green, Blue };
+
+struct BoxSpec {
+    BoxKind kind;
+    double initialWeight;
+};
+
+/**
+ * Creates the Box objects of a custom roster, in roster order.
+ */
+std::vector<std::unique_ptr<Box> > makeBoxes(const std::vector<BoxSpec>& roster) {
+    std::vector<std::unique_ptr<Box> > boxes;
+    boxes.reserve(roster.size());
+    for (const auto& spec : roster) {
+        boxes.emplace_back(spec.kind == BoxKind::Green ? Box::makeGreenBox(spec.initialWeight)
+                                                       : Box::makeBlueBox(spec.initialWeight));
+    }
+    return boxes;
+}
+
+/**
+ * Heap entry of the custom-roster selectors, ordered by (weight, box).
+ */
+struct RosterHeapEntry {
+    double weight;
+    uint32_t box;
+
+    bool operator<(const RosterHeapEntry& rhs) const {
+        // Branch-free: the outcome is data dependent and would mispredict half the time
+        return (weight < rhs.weight) | ((weight == rhs.weight) & (box < rhs.box));
+    }
+};
+
+/**
+ * Box state kept in one cache line: GreenBox window or BlueBox min/max.
+ */
+struct RosterBox {
+    double window[3] = { 0.0, 0.0, 0.0 };
+    double minWeight = 0.0;
+    double maxWeight = 0.0;
+    uint8_t absorbed = 0;  // window entries in use (green), or 1 once a weight was seen (blue)
+    bool green = true;
+
+    double absorb(double weight) {
+        if (green) {
+            if (absorbed == 3) {
+                window[0] = window[1];
+                window[1] = window[2];
+                window[2] = weight;
+            }
+            else {
+                window[absorbed++] = weight;
+            }
+            double sum = 0;
+            for (int i = 0; i < absorbed; ++i) sum += window[i];
+            double m = sum / absorbed;
+            return m * m;
+        }
+        if (absorbed != 0) {
+            minWeight = std::min(minWeight, weight);
+            maxWeight = std::max(maxWeight, weight);
+        }
+        else {
+            minWeight = maxWeight = weight;
+            absorbed = 1;
+        }
+        return cantorPairing(minWeight, maxWeight);
+    }
+};
+
+/**
+ * One game on a large custom roster, advanced in small resumable steps.
+ *
+ * The lightest box is found with a binary min-heap ordered by (weight, roster index),
+ * which picks the same box as the linear scan in Player::takeTurn. Each call to advance()
+ * touches one heap level (or absorbs one token) and prefetches what the next call needs,
+ * so callers can interleave several games and overlap their cache misses.
+ */
+class LargeRosterGame {
+public:
+    LargeRosterGame(const std::vector<BoxSpec>& roster, const uint32_t* input_weights, size_t count)
+        : tokens_(input_weights), count_(count), boxes_(roster.size()) {
+        heap_.reserve(roster.size());
+        for (size_t i = 0; i < roster.size(); ++i) {
+            boxes_[i].green = roster[i].kind == BoxKind::Green;
+            heap_.push_back({ roster[i].initialWeight, static_cast<uint32_t>(i) });
+        }
+        for (size_t i = heap_.size() / 2; i-- > 0;) {
+            siftDown(i);
+        }
+        if (!heap_.empty()) __builtin_prefetch(&boxes_[heap_[0].box], 1);
+    }
+
+    bool done() const { return turn_ == count_ || heap_.empty(); }
+
+    /**
+     * Performs the next step: absorbs the current token into the lightest box, or moves
+     * that box one level down the heap.
+     */
+    void advance() {
+        if (sifting_) {
+            siftLevel();
+            return;
+        }
+        HeapEntry& top = heap_[0];
+        double weight = tokens_[turn_];
+        top.weight += weight;
+        double score = boxes_[top.box].absorb(weight);
+        fingerprint_ = foldTurn(fingerprint_, turn_, top.box, score);
+        scores_[turn_ % 2] += score;
+        ++turn_;
+        sifting_ = true;
+        position_ = 0;
+        prefetchChildren(0);
+    }
+
+    GameResult result() const {
+        GameResult r;
+        r.scoreA = scores_[0];
+        r.scoreB = scores_[1];
+        r.fingerprint = fingerprint_;
+        return r;
+    }
+
+private:
+    typedef RosterHeapEntry HeapEntry;
+
+    void prefetchChildren(size_t position) const {
+        size_t child = 2 * position + 1;
+        if (child < heap_.size()) __builtin_prefetch(&heap_[child]);
+    }
+
+    /**
+     * Moves the entry at position_ one level down; when it settles, prefetches the next box.
+     */
+    void siftLevel() {
+        size_t child = 2 * position_ + 1;
+        if (child < heap_.size()) {
+            size_t right = child + 1 < heap_.size() ? child + 1 : child;
+            child = heap_[right] < heap_[child] ? right : child;
+            if (heap_[child] < heap_[position_]) {
+                std::swap(heap_[child], heap_[position_]);
+                position_ = child;
+                prefetchChildren(position_);
+                return;
+            }
+        }
+        sifting_ = false;
+        if (!done()) __builtin_prefetch(&boxes_[heap_[0].box], 1);
+    }
+
+    void siftDown(size_t position) {
+        for (size_t child = 2 * position + 1; child < heap_.size(); child = 2 * position + 1) {
+            if (child + 1 < heap_.size() && heap_[child + 1] < heap_[child]) ++child;
+            if (!(heap_[child] < heap_[position])) break;
+            std::swap(heap_[child], heap_[position]);
+            position = child;
+        }
+    }
+
+    const uint32_t* tokens_;
+    size_t count_;
+    size_t turn_ = 0;
+    std::vector<HeapEntry> heap_;
+    std::vector<RosterBox> boxes_;
+    double scores_[2] = { 0.0, 0.0 };
+    uint64_t fingerprint_ = kFingerprintSeed;
+    bool sifting_ = false;
+    size_t position_ = 0;
+};
+
+/**
+ * Plays one game on a custom roster with the heap selector.
+ */
+GameResult playLargeRoster(const std::vector<BoxSpec>& roster, const std::vector<uint32_t>& input_weights) {
+    LargeRosterGame game(roster, input_weights.data(), input_weights.size());
+    while (!game.done()) game.advance();
+    return game.result();
+}
+
+/**
+ * Plays many games on the same custom roster, interleaving the steps of up to
+ * `interleave` games round-robin so their memory accesses overlap.
+ */
+std::vector<GameResult> playLargeRosterBatch(const std::vector<BoxSpec>& roster,
+    const std::vector<std::vector<uint32_t> >& games, size_t interleave = 8) {
+    std::vector<GameResult> results(games.size());
+    interleave = std::max<size_t>(1, interleave);
+    for (size_t first = 0; first < games.size(); first += interleave) {
+        size_t last = std::min(games.size(), first + interleave);
+        std::vector<LargeRosterGame> group;
+        group.reserve(last - first);
+        for (size_t g = first; g < last; ++g) {
+            group.emplace_back(roster, games[g].data(), games[g].size());
+        }
+        for (bool busy = true; busy;) {
+            busy = false;
+            for (auto& game : group) {
+                if (game.done()) continue;
+                game.advance();
+                busy = true;
+            }
+        }
+        for (size_t g = first; g < last; ++g) {
+            results[g] = group[g - first].result();
+        }
+    }
+    return results;
+}
+
+/**
+ * Game whose roster changes while it is played. Ties between equally light boxes go
+ * to the box added first, as if new boxes were appended to (and retired ones erased
+ * from) the boxes vector of play().
+ *
+ * The selector is a binary min-heap with a position map per id, so adding, removing
+ * and absorbing are O(log N) with no rebuild. Slots of retired boxes are reused by
+ * later addBox() calls, so memory follows the largest roster rather than the number
+ * of boxes ever added. An id pairs the slot with the slot's generation, which every
+ * removal bumps, so the id of a retired box stays invalid after its slot is reused.
+ */
+class DynamicRosterGame {
+public:
+    typedef uint64_t BoxId;  // slot in the low 32 bits, generation in the high 32 bits
+
+    static uint32_t slotOf(BoxId id) { return static_cast<uint32_t>(id); }
+
+    explicit DynamicRosterGame(const std::vector<BoxSpec>& roster = {}) {
+        for (const auto& spec : roster) addBox(spec);
+    }
+
+    BoxId addBox(const BoxSpec& spec) {
+        uint32_t slot;
+        if (!freeSlots_.empty()) {
+            slot = freeSlots_.back();
+            freeSlots_.pop_back();
+            boxes_[slot] = RosterBox();
+        }
+        else {
+            if (boxes_.size() == kRemoved) throw std::length_error("box slots exhausted");
+            slot = static_cast<uint32_t>(boxes_.size());
+            boxes_.emplace_back();
+            positions_.push_back(kRemoved);
+            generations_.push_back(0);
+        }
+        if (nextOrder_ == std::numeric_limits<uint32_t>::max()) renumber();
+        boxes_[slot].green = spec.kind == BoxKind::Green;
+        positions_[slot] = static_cast<uint32_t>(heap_.size());
+        heap_.push_back({ spec.initialWeight, nextOrder_++, slot });
+        siftUp(heap_.size() - 1);
+        return idOf(slot);
+    }
+
+    /**
+     * Retires a box; throws std::out_of_range if the id is unknown or already retired.
+     */
+    void removeBox(BoxId id) {
+        uint32_t position = positionOf(id);
+        uint32_t slot = slotOf(id);
+        positions_[slot] = kRemoved;
+        // A slot whose generation ran out is never reused, so no id can come back
+        if (++generations_[slot] != std::numeric_limits<uint32_t>::max()) freeSlots_.push_back(slot);
+        HeapEntry last = heap_.back();
+        heap_.pop_back();
+        if (position == heap_.size()) return;
+        place(position, last);
+        siftUp(position);
+        siftDown(positions_[last.slot]);
+    }
+
+    bool contains(BoxId id) const {
+        uint32_t slot = slotOf(id);
+        return slot < positions_.size() && positions_[slot] != kRemoved && generations_[slot] == (id >> 32);
+    }
+
+    size_t size() const { return heap_.size(); }
+
+    double weight(BoxId id) const { return heap_[positionOf(id)].weight; }
+
+    /**
+     * Lets the lightest box absorb the token for the player whose turn it is and
+     * returns the box's id; throws std::logic_error if the roster is empty.
+     */
+    BoxId step(uint32_t token) {
+        if (heap_.empty()) throw std::logic_error("no boxes left to absorb the token");
+        HeapEntry& top = heap_[0];
+        double weight = token;
+        top.weight += weight;
+        double score = boxes_[top.slot].absorb(weight);
+        fingerprint_ = foldTurn(fingerprint_, turn_, top.slot, score);
+        scores_[turn_++ % 2] += score;
+        BoxId id = idOf(top.slot);
+        siftDown(0);
+        return id;
+    }
+
+    GameResult result() const {
+        GameResult r;
+        r.scoreA = scores_[0];
+        r.scoreB = scores_[1];
+        r.fingerprint = fingerprint_;
+        return r;
+    }
+
+private:
+    /**
+     * Heap entry ordered by weight, then by insertion order, which unlike the slot
+     * does not repeat when slots are reused.
+     */
+    struct HeapEntry {
+        double weight;
+        uint32_t order;
+        uint32_t slot;
+
+        bool operator<(const HeapEntry& rhs) const {
+            return (weight < rhs.weight) | ((weight == rhs.weight) & (order < rhs.order));
+        }
+    };
+
+    static const uint32_t kRemoved = std::numeric_limits<uint32_t>::max();
+
+    /**
+     * Renumbers the insertion orders of the roster densely from 0 once the counter runs
+     * out. Relative order is kept, so the heap stays valid.
+     */
+    void renumber() {
+        std::vector<HeapEntry*> byOrder;
+        for (auto& entry : heap_) byOrder.push_back(&entry);
+        std::sort(byOrder.begin(), byOrder.end(),
+            [](const HeapEntry* lhs, const HeapEntry* rhs) { return lhs->order < rhs->order; });
+        nextOrder_ = 0;
+        for (HeapEntry* entry : byOrder) entry->order = nextOrder_++;
+    }
+
+    BoxId idOf(uint32_t slot) const { return (static_cast<BoxId>(generations_[slot]) << 32) | slot; }
+
+    uint32_t positionOf(BoxId id) const {
+        if (!contains(id)) throw std::out_of_range("unknown box id " + std::to_string(id));
+        return positions_[slotOf(id)];
+    }
+
+    void place(size_t position, const HeapEntry& entry) {
+        heap_[position] = entry;
+        positions_[entry.slot] = static_cast<uint32_t>(position);
+    }
+
+    void siftUp(size_t position) {
+        HeapEntry entry = heap_[position];
+        while (position > 0) {
+            size_t parent = (position - 1) / 2;
+            if (!(entry < heap_[parent])) break;
+            place(position, heap_[parent]);
+            position = parent;
+        }
+        place(position, entry);
+    }
+
+    void siftDown(size_t position) {
+        HeapEntry entry = heap_[position];
+        for (size_t child = 2 * position + 1; child < heap_.size(); child = 2 * position + 1) {
+            if (child + 1 < heap_.size() && heap_[child + 1] < heap_[child]) ++child;
+            if (!(heap_[child] < entry)) break;
+            place(position, heap_[child]);
+            position = child;
+        }
+        place(position, entry);
+    }
+
+    std::vector<HeapEntry> heap_;
+    std::vector<uint32_t> positions_;    // heap position per slot, kRemoved once retired
+    std::vector<uint32_t> generations_;  // per slot, bumped by every removal
+    std::vector<RosterBox> boxes_;       // per slot
+    std::vector<uint32_t> freeSlots_;    // retired slots, reused by addBox()
+    uint32_t nextOrder_ = 0;
+    uint64_t turn_ = 0;
+    double scores_[2] = { 0.0, 0.0 };
+    uint64_t fingerprint_ = kFingerprintSeed;
+};
+
+const uint32_t DynamicRosterGame::kRemoved;
+
+/**
+ * Thread-local count of open NoAllocationScopes.
+ */
+thread_local int g_allocationForbidden = 0;
+
+/**
+ * Marks a region that must not allocate, e.g. a real-time hot path. In debug builds
+ * of the test executable the global operator new below asserts on any allocation
+ * inside such a region; elsewhere the scope costs nothing.
+ */
+class NoAllocationScope {
+public:
+    NoAllocationScope() { ++g_allocationForbidden; }
+    ~NoAllocationScope() { --g_allocationForbidden; }
+    NoAllocationScope(const NoAllocationScope&) = delete;
+    NoAllocationScope& operator=(const NoAllocationScope&) = delete;
+};
+
+#if !defined(NDEBUG) && !defined(ASAPHUS_NO_TESTS)
+// Not replaced in the library build, whose host process owns the global allocator
+void* operator new(size_t size) {
+    assert(g_allocationForbidden == 0 && "allocation inside a NoAllocationScope");
+    void* p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+// Out of line, or GCC 12 pairs the inlined free() with operator new at the call sites
+// and reports -Wmismatched-new-delete although both sides are replaced consistently
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+#endif
+
+/**
+ * Settings of a real-time game.
+ */
+struct RealtimeConfig {
+    bool lockMemory = false;  // mlock the game state and statistics
+    int cpu = -1;             // pin the constructing thread to this CPU, -1 keeps the affinity
+};
+
+/**
+ * Per-token latency statistics with a log2 histogram (bucket i counts latencies in [2^i, 2^(i+1)) ns).
+ */
+struct JitterStats {
+    static const int kBuckets = 64;
+
+    uint64_t samples = 0;
+    uint64_t minNanos = std::numeric_limits<uint64_t>::max();
+    uint64_t maxNanos = 0;
+    double totalNanos = 0.0;
+    uint64_t histogram[kBuckets] = {};
+
+    void record(uint64_t nanos) {
+        ++samples;
+        minNanos = std::min(minNanos, nanos);
+        maxNanos = std::max(maxNanos, nanos);
+        totalNanos += nanos;
+        int bucket = nanos == 0 ? 0 : 63 - __builtin_clzll(nanos);
+        ++histogram[bucket];
+    }
+
+    double meanNanos() const { return samples ? totalNanos / samples : 0.0; }
+
+    /**
+     * Upper bound of the histogram bucket holding the given quantile (0 < q <= 1).
+     */
+    uint64_t quantileNanos(double q) const {
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q * samples));
+        uint64_t seen = 0;
+        for (int b = 0; b < kBuckets; ++b) {
+            seen += histogram[b];
+            if (seen >= rank && seen > 0) return std::min(maxNanos, (uint64_t(2) << b) - 1);
+        }
+        return maxNanos;
+    }
+};
+
+const int JitterStats::kBuckets;
+
+/**
+ * Game with deterministic per-token latency for low-latency feeds.
+ *
+ * All state lives inside the object, so stepping never allocates (asserted through
+ * NoAllocationScope in debug builds). The constructor optionally locks that memory
+ * and pins the calling thread, which should then be the one calling step() and
+ * destroying the game; the destructor restores the thread's previous affinity.
+ * Failing to lock or pin throws std::system_error.
+ */
+class RealtimeGame {
+public:
+    explicit RealtimeGame(const RealtimeConfig& config) {
+        if (config.cpu >= 0) {
+            int error = pthread_getaffinity_np(pthread_self(), sizeof(previousAffinity_), &previousAffinity_);
+            if (error != 0) throw std::system_error(error, std::generic_category(), "reading CPU affinity");
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(config.cpu, &set);
+            error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (error != 0) throw std::system_error(error, std::generic_category(), "pinning to CPU");
+            pinned_ = true;
+        }
+        if (config.lockMemory) {
+            if (mlock(this, sizeof(*this)) != 0) {
+                int error = errno;
+                restoreAffinity();
+                throw std::system_error(error, std::generic_category(), "locking real-time game state");
+            }
+            locked_ = true;
+        }
+    }
+
+    ~RealtimeGame() {
+        if (locked_) munlock(this, sizeof(*this));
+        restoreAffinity();
+    }
+
+    RealtimeGame(const RealtimeGame&) = delete;
+    RealtimeGame& operator=(const RealtimeGame&) = delete;
+
+    /**
+     * Plays the next token and returns the score credited to the current player.
+     */
+    double step(uint32_t token) {
+        NoAllocationScope noAllocation;
+        auto start = std::chrono::steady_clock::now();
+        double score = state_.step(token);
+        auto end = std::chrono::steady_clock::now();
+        jitter_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        return score;
+    }
+
+    const GameState& state() const { return state_; }
+
+    const JitterStats& jitter() const { return jitter_; }
+
+    bool memoryLocked() const { return locked_; }
+
+    bool pinned() const { return pinned_; }
+
+private:
+    void restoreAffinity() {
+        if (pinned_) pthread_setaffinity_np(pthread_self(), sizeof(previousAffinity_), &previousAffinity_);
+        pinned_ = false;
+    }
+
+    GameState state_;
+    JitterStats jitter_;
+    cpu_set_t previousAffinity_;
+    bool locked_ = false;
+    bool pinned_ = false;
+};
+
+/**
+ * Aggregate statistics of a batch, summed over all games that completed.
+ */
+struct BatchStats {
+    uint64_t completed = 0;
+    uint64_t failed = 0;
+    uint64_t tokens = 0;
+    uint64_t winsA = 0;
+    uint64_t winsB = 0;
+    uint64_t ties = 0;
+    double totalScoreA = 0.0;
+    double totalScoreB = 0.0;
+
+    void add(const GameResult& result, size_t length) {
+        ++completed;
+        tokens += length;
+        totalScoreA += result.scoreA;
+        totalScoreB += result.scoreB;
+        (result.scoreA > result.scoreB ? winsA : result.scoreA < result.scoreB ? winsB : ties) += 1;
+    }
+
+    void merge(const BatchStats& other) {
+        completed += other.completed;
+        failed += other.failed;
+        tokens += other.tokens;
+        winsA += other.winsA;
+        winsB += other.winsB;
+        ties += other.ties;
+        totalScoreA += other.totalScoreA;
+        totalScoreB += other.totalScoreB;
+    }
+};
+
+/**
+ * Outcome of a multi-process batch. failed[g] is set for games whose worker crashed.
+ */
+struct ProcessBatchResult {
+    std::vector<GameResult> results;
+    std::vector<uint8_t> failed;
+    BatchStats stats;
+    unsigned restarts = 0;
+};
+
+/**
+ * Plays every game in forked worker processes, so a game that crashes its worker only
+ * fails that game.
+ *
+ * Workers pull game indices from an atomic cursor in a shared anonymous mapping, write
+ * scores straight into a shared result array and accumulate statistics in their own
+ * shared slot. Before each game a worker publishes the index it is working on; if the
+ * worker dies, the parent marks that game failed and forks a replacement for the slot.
+ * The games themselves are read from the parent's memory inherited by fork().
+ *
+ * A slot double-buffers its statistics: a finished game is added to the spare copy,
+ * and a single store of the slot state then flips the copies and marks the game done,
+ * so a worker dying at any point counts its game either completed or failed, never both.
+ *
+ * The workers run in a process group of their own, which the parent blocks on with
+ * waitpid(), so other children of the calling program keep their exit statuses. As
+ * terminal signals no longer reach them, they are killed when the parent dies. If
+ * the batch fails, e.g. because a worker cannot be forked, the running workers are
+ * killed and reaped before the exception propagates.
+ */
+ProcessBatchResult playBatchInProcesses(const std::vector<std::vector<uint32_t> >& games,
+    const GameEngine& engine, unsigned workers = defaultThreadCount()) {
+    // Slot state: (game + 1) << 2 | playing << 1 | index of the published stats copy
+    struct WorkerSlot {
+        std::atomic<uint64_t> state;
+        BatchStats stats[2];
+    };
+    struct Shared {
+        std::atomic<uint64_t> next;
+    };
+    enum : uint8_t { kPending = 0, kDone = 1, kFailed = 2 };
+    const uint64_t kPlaying = 2, kCopy = 1;
+
+    workers = std::max(1u, workers);
+    const size_t n = games.size();
+    size_t bytes = sizeof(Shared) + workers * sizeof(WorkerSlot) + n * sizeof(GameResult) + n;
+    void* mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) throw std::system_error(errno, std::generic_category(), "mapping shared batch state");
+    auto* shared = new (mapping) Shared{};
+    auto* slots = reinterpret_cast<WorkerSlot*>(shared + 1);
+    auto* results = reinterpret_cast<GameResult*>(slots + workers);
+    auto* status = reinterpret_cast<uint8_t*>(results + n);
+    for (unsigned w = 0; w < workers; ++w) new (&slots[w]) WorkerSlot{};
+    std::fill(status, status + n, uint8_t(kPending));
+
+    ProcessBatchResult batch;
+    std::vector<pid_t> pids(workers, -1);  // running worker of each slot, -1 if none
+    unsigned running = 0;
+    pid_t group = 0;  // process group of the workers, led by the first one forked while none ran
+    auto spawn = [&](unsigned slot) {
+        pid_t leader = running == 0 ? 0 : group;
+        pid_t parent = getpid();
+        pid_t pid = fork();
+        if (pid < 0) throw std::system_error(errno, std::generic_category(), "forking batch worker");
+        if (pid > 0) {
+            // Both sides join the group, so it is set before either the worker or the parent continues
+            if (setpgid(pid, leader == 0 ? pid : leader) != 0 && errno != EACCES) {
+                int error = errno;
+                kill(pid, SIGKILL);
+                while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {
+                }
+                throw std::system_error(error, std::generic_category(), "grouping batch worker");
+            }
+            group = leader == 0 ? pid : leader;
+            pids[slot] = pid;
+            ++running;
+            return;
+        }
+        if (setpgid(0, leader) != 0) _exit(1);
+        if (prctl(PR_SET_PDEATHSIG, SIGKILL) != 0 || getppid() != parent) _exit(1);
+        for (int sig : { SIGSEGV, SIGABRT, SIGFPE, SIGILL, SIGBUS }) std::signal(sig, SIG_DFL);
+        WorkerSlot& mine = slots[slot];
+        try {
+            for (uint64_t g = shared->next.fetch_add(1); g < n; g = shared->next.fetch_add(1)) {
+                uint64_t copy = mine.state.load() & kCopy;
+                mine.state.store((g + 1) << 2 | kPlaying | copy);
+                results[g] = engine.play(games[g].data(), games[g].size());
+                mine.stats[copy ^ 1] = mine.stats[copy];
+                mine.stats[copy ^ 1].add(results[g], games[g].size());
+                mine.state.store((g + 1) << 2 | (copy ^ 1));
+                status[g] = kDone;
+            }
+        }
+        catch (...) {
+            _exit(1);  // fails the current game like a crash; the exception must not reach the parent's code
+        }
+        _exit(0);
+    };
+
+    try {
+        for (unsigned w = 0; w < workers; ++w) spawn(w);
+        while (running > 0) {
+            int wstatus = 0;
+            pid_t pid = waitpid(-group, &wstatus, 0);
+            if (pid < 0) {
+                if (errno == EINTR) continue;
+                throw std::system_error(errno, std::generic_category(), "waiting for batch worker");
+            }
+            unsigned w = static_cast<unsigned>(std::find(pids.begin(), pids.end(), pid) - pids.begin());
+            pids[w] = -1;
+            --running;
+
+            // The slot state tells whether the worker's last game was published before it exited
+            uint64_t state = slots[w].state.load();
+            if (state >> 2 != 0) status[(state >> 2) - 1] = state & kPlaying ? kFailed : kDone;
+            if (WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0) continue;
+            ++batch.restarts;
+            if (shared->next.load() < n) spawn(w);
+        }
+
+        batch.results.assign(results, results + n);
+        batch.failed.resize(n);
+        for (size_t g = 0; g < n; ++g) {
+            batch.failed[g] = status[g] != kDone;
+            batch.stats.failed += batch.failed[g];
+        }
+        for (unsigned w = 0; w < workers; ++w) {
+            batch.stats.merge(slots[w].stats[slots[w].state.load() & kCopy]);
+        }
+    }
+    catch (...) {
+        for (pid_t pid : pids) {
+            if (pid < 0) continue;
+            kill(pid, SIGKILL);
+            int wstatus = 0;
+            while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR) {
+            }
+        }
+        munmap(mapping, bytes);
+        throw;
+    }
+    munmap(mapping, bytes);
+    return batch;
+}
+
+/**
+ * Reads a token file: raw 32-bit little-endian token weights.
+ */
+std::vector<uint32_t> readTokenFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) throw std::runtime_error("cannot open token file " + path);
+    std::streamsize bytes = in.tellg();
+    if (bytes % sizeof(uint32_t) != 0) throw std::runtime_error("truncated token file " + path);
+    std::vector<uint32_t> tokens(static_cast<size_t>(bytes) / sizeof(uint32_t));
+    in.seekg(0);
+    in.read(reinterpret_cast<char*>(tokens.data()), bytes);
+    return tokens;
+}
+
+void writeTokenFile(const std::string& path, const std::vector<uint32_t>& tokens) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(tokens.data()), tokens.size() * sizeof(uint32_t));
+    if (!out) throw std::runtime_error("cannot write token file " + path);
+}
+
+/**
+ * Reads a manifest: one token file path per non-empty line. Game ids are line positions.
+ */
+std::vector<std::string> readManifest(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) throw std::runtime_error("cannot open manifest " + path);
+    std::vector<std::string> files;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty()) files.push_back(line);
+    }
+    return files;
+}
+
+/**
+ * Mergeable histogram of score margins (A - B): log2 buckets of |margin| per sign.
+ */
+struct MarginSketch {
+    static const int kBuckets = 64;
+
+    uint64_t positive[kBuckets] = {};
+    uint64_t negative[kBuckets] = {};
+    uint64_t zero = 0;
+
+    void add(double margin) {
+        if (margin == 0) {
+            ++zero;
+            return;
+        }
+        double magnitude = std::fabs(margin);
+        int bucket = magnitude < 1 ? 0 : std::min(kBuckets - 1, 1 + static_cast<int>(std::log2(magnitude)));
+        ++(margin > 0 ? positive : negative)[bucket];
+    }
+
+    void merge(const MarginSketch& other) {
+        for (int b = 0; b < kBuckets; ++b) {
+            positive[b] += other.positive[b];
+            negative[b] += other.negative[b];
+        }
+        zero += other.zero;
+    }
+};
+
+const int MarginSketch::kBuckets;
+
+/**
+ * Per-game result of a partition run.
+ */
+struct GameRecord {
+    uint64_t id;
+    uint64_t length;
+    double scoreA;
+    double scoreB;
+    uint64_t fingerprint;
+};
+
+/**
+ * Fingerprint of a whole run: the game fingerprints folded in game id order.
+ */
+uint64_t batchFingerprint(const std::vector<GameRecord>& records) {
+    uint64_t fingerprint = kFingerprintSeed;
+    for (const auto& record : records) foldTurnBits<uint64_t>(fingerprint, record.id, record.length, record.fingerprint);
+    return fingerprint;
+}
+
+/**
+ * Result of shard `shard` of `shards` over a manifest of manifestGames games,
+ * or of a merge of all shards (shard 0 of 1).
+ */
+struct PartialResult {
+    uint32_t shard = 0;
+    uint32_t shards = 1;
+    uint64_t manifestGames = 0;
+    std::vector<GameRecord> records;  // ordered by game id
+    BatchStats stats;
+    MarginSketch margins;
+};
+
+const uint32_t kPartialMagic = 0x52505341;  // "ASPR"
+const uint32_t kPartialVersion = 3;
+const size_t kPartialRecordBytes = 40;
+
+/**
+ * Number of games of a manifest with manifestGames games that fall into shard `shard` of `shards`.
+ */
+uint64_t shardGameCount(uint64_t manifestGames, uint32_t shard, uint32_t shards) {
+    return shard < manifestGames ? (manifestGames - shard + shards - 1) / shards : 0;
+}
+
+/**
+ * Writes a partial result in the compact binary partial-result format: every field
+ * in turn, in host byte order.
+ */
+void writePartial(const std::string& path, const PartialResult& partial) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    auto put = [&out](const auto& value) { out.write(reinterpret_cast<const char*>(&value), sizeof(value)); };
+    put(kPartialMagic);
+    put(kPartialVersion);
+    put(partial.shard);
+    put(partial.shards);
+    put(partial.manifestGames);
+    put(static_cast<uint64_t>(partial.records.size()));
+    for (const auto& record : partial.records) {
+        put(record.id);
+        put(record.length);
+        put(record.scoreA);
+        put(record.scoreB);
+        put(record.fingerprint);
+    }
+    const BatchStats& stats = partial.stats;
+    put(stats.completed);
+    put(stats.failed);
+    put(stats.tokens);
+    put(stats.winsA);
+    put(stats.winsB);
+    put(stats.ties);
+    put(stats.totalScoreA);
+    put(stats.totalScoreB);
+    for (uint64_t count : partial.margins.positive) put(count);
+    for (uint64_t count : partial.margins.negative) put(count);
+    put(partial.margins.zero);
+    if (!out) throw std::runtime_error("cannot write partial result " + path);
+}
+
+/**
+ * Reads a partial result written by writePartial(). Throws std::runtime_error if the file
+ * is truncated or not a consistent partial result.
+ */
+PartialResult readPartial(const std::string& path) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) throw std::runtime_error("cannot open partial result " + path);
+    uint64_t remaining = static_cast<uint64_t>(in.tellg());
+    in.seekg(0);
+    auto get = [&in, &path, &remaining](auto& value) {
+        if (remaining < sizeof(value) || !in.read(reinterpret_cast<char*>(&value), sizeof(value))) {
+            throw std::runtime_error("truncated partial result " + path);
+        }
+        remaining -= sizeof(value);
+    };
+    auto invalid = [&path](const std::string& what) { return std::runtime_error(what + " in partial result " + path); };
+    uint32_t magic = 0, version = 0;
+    uint64_t count = 0;
+    PartialResult partial;
+    get(magic);
+    get(version);
+    if (magic != kPartialMagic || version != kPartialVersion) {
+        throw std::runtime_error("not a partial result file: " + path);
+    }
+    get(partial.shard);
+    get(partial.shards);
+    get(partial.manifestGames);
+    get(count);
+    if (partial.shards == 0 || partial.shard >= partial.shards) throw invalid("shard index out of range");
+    if (count > shardGameCount(partial.manifestGames, partial.shard, partial.shards)) {
+        throw invalid("more records than the shard has games");
+    }
+    if (count > remaining / kPartialRecordBytes) throw std::runtime_error("truncated partial result " + path);
+    partial.records.resize(count);
+    for (auto& record : partial.records) {
+        get(record.id);
+        get(record.length);
+        get(record.scoreA);
+        get(record.scoreB);
+        get(record.fingerprint);
+        if (record.id >= partial.manifestGames || record.id % partial.shards != partial.shard) {
+            throw invalid("game " + std::to_string(record.id) + " outside the shard");
+        }
+    }
+    BatchStats& stats = partial.stats;
+    get(stats.completed);
+    get(stats.failed);
+    get(stats.tokens);
+    get(stats.winsA);
+    get(stats.winsB);
+    get(stats.ties);
+    get(stats.totalScoreA);
+    get(stats.totalScoreB);
+    for (uint64_t& count : partial.margins.positive) get(count);
+    for (uint64_t& count : partial.margins.negative) get(count);
+    get(partial.margins.zero);
+    return partial;
+}
+
+/**
+ * Plays shard `shard` of `shards` of a manifest (the games whose id % shards == shard)
+ * and returns its partial result.
+ */
+PartialResult runShard(const std::string& manifest, uint32_t shard, uint32_t shards,
+    const GameEngine& engine, unsigned threads = defaultThreadCount()) {
+    if (shards == 0 || shard >= shards) throw std::invalid_argument("shard index out of range");
+    std::vector<std::string> files = readManifest(manifest);
+    PartialResult partial;
+    partial.shard = shard;
+    partial.shards = shards;
+    partial.manifestGames = files.size();
+
+    std::vector<std::vector<uint32_t> > games;
+    for (uint64_t id = shard; id < files.size(); id += shards) {
+        games.push_back(readTokenFile(files[id]));
+    }
+    std::vector<GameResult> results = playBatch(games, engine, threads);
+    for (size_t i = 0; i < games.size(); ++i) {
+        partial.records.push_back(
+            { shard + i * shards, games[i].size(), results[i].scoreA, results[i].scoreB, results[i].fingerprint });
+        partial.stats.add(results[i], games[i].size());
+        partial.margins.add(results[i].scoreA - results[i].scoreB);
+    }
+    return partial;
+}
+
+/**
+ * Combines the partial results of all shards of one manifest. The outcome does not
+ * depend on the order of the partials: records are ordered by game id and score totals
+ * are summed in that order. Throws if shards are missing, duplicated or inconsistent.
+ */
+PartialResult mergePartials(const std::vector<PartialResult>& partials) {
+    if (partials.empty()) throw std::invalid_argument("no partial results to merge");
+    PartialResult merged;
+    merged.shards = 1;
+    merged.manifestGames = partials[0].manifestGames;
+    std::vector<bool> seen(partials[0].shards, false);
+    for (const auto& partial : partials) {
+        if (partial.shards != seen.size() || partial.manifestGames != merged.manifestGames) {
+            throw std::runtime_error("partial results come from different partitionings");
+        }
+        if (partial.shard >= partial.shards) throw std::runtime_error("shard index out of range");
+        if (seen[partial.shard]) throw std::runtime_error("shard " + std::to_string(partial.shard) + " given twice");
+        seen[partial.shard] = true;
+        merged.records.insert(merged.records.end(), partial.records.begin(), partial.records.end());
+        merged.stats.merge(partial.stats);
+        merged.margins.merge(partial.margins);
+    }
+    if (std::find(seen.begin(), seen.end(), false) != seen.end()) {
+        throw std::runtime_error("partial results are missing shards");
+    }
+    std::sort(merged.records.begin(), merged.records.end(),
+        [](const GameRecord& lhs, const GameRecord& rhs) { return lhs.id < rhs.id; });
+    merged.stats.totalScoreA = merged.stats.totalScoreB = 0.0;
+    for (const auto& record : merged.records) {
+        merged.stats.totalScoreA += record.scoreA;
+        merged.stats.totalScoreB += record.scoreB;
+    }
+    return merged;
+}
+
+/**
+ * Fixed-size encoding of a GameState for session storage (96 bytes).
+ *
+ * After normalize() the absorbed totals differ by less than one token, so they fit in
+ * 32 bits each next to the 64-bit base. Window sizes and blue flags share the top
+ * byte of the turn counter.
+ */
+struct PackedGameState {
+    uint32_t absorbed[4];
+    uint32_t window[2][3];
+    uint32_t blueMin[2];
+    uint32_t blueMax[2];
+    uint64_t base;
+    double scores[2];
+    uint64_t turnAndFlags;  // turn in the low 56 bits
+    uint64_t fingerprint;
+
+    static const int kFlagShift = 56;
+
+    static PackedGameState pack(GameState state) {
+        state.normalize();
+        PackedGameState packed;
+        for (int box = 0; box < 4; ++box) packed.absorbed[box] = static_cast<uint32_t>(state.absorbed[box]);
+        std::copy(&state.window[0][0], &state.window[0][0] + 6, &packed.window[0][0]);
+        std::copy(state.blueMin, state.blueMin + 2, packed.blueMin);
+        std::copy(state.blueMax, state.blueMax + 2, packed.blueMax);
+        packed.base = state.base;
+        packed.scores[0] = state.scores[0];
+        packed.scores[1] = state.scores[1];
+        uint64_t flags = state.windowSize[0] | state.windowSize[1] << 2 | state.blueSeen[0] << 4 | state.blueSeen[1] << 5;
+        packed.turnAndFlags = state.turn | flags << kFlagShift;
+        packed.fingerprint = state.fingerprint;
+        return packed;
+    }
+
+    GameState unpack() const {
+        GameState state;
+        std::copy(absorbed, absorbed + 4, state.absorbed);
+        std::copy(&window[0][0], &window[0][0] + 6, &state.window[0][0]);
+        std::copy(blueMin, blueMin + 2, state.blueMin);
+        std::copy(blueMax, blueMax + 2, state.blueMax);
+        state.base = base;
+        state.scores[0] = scores[0];
+        state.scores[1] = scores[1];
+        uint64_t flags = turnAndFlags >> kFlagShift;
+        state.windowSize[0] = flags & 3;
+        state.windowSize[1] = flags >> 2 & 3;
+        state.blueSeen[0] = flags >> 4 & 1;
+        state.blueSeen[1] = flags >> 5 & 1;
+        state.turn = turnAndFlags & ((uint64_t(1) << kFlagShift) - 1);
+        state.fingerprint = fingerprint;
+        return state;
+    }
+};
+
+const int PackedGameState::kFlagShift;
+static_assert(sizeof(PackedGameState) == 96, "packed state must stay compact");
+
+/**
+ * One token addressed to a session, as passed to SessionTable::stepBatch().
+ */
+struct SessionToken {
+    uint64_t session;
+    uint32_t token;
+};
+
+/**
+ * Live games keyed by session id, for serving many concurrent sessions.
+ *
+ * Sessions are PackedGameStates in fixed-size slabs with a free list, found through
+ * an open-addressing hash map (linear probing, backward-shift deletion). Sessions that
+ * were idle for a while can be spilled to a local file and are read back on their
+ * next access. Not thread-safe.
+ */
+class SessionTable {
+public:
+    static const size_t kSlabSessions = 1 << 14;
+
+    /**
+     * Creates an empty table; spilling needs a spill file path.
+     */
+    explicit SessionTable(const std::string& spill_path = "") : spillPath_(spill_path) {}
+
+    SessionTable(const SessionTable&) = delete;
+    SessionTable& operator=(const SessionTable&) = delete;
+
+    ~SessionTable() {
+        if (spillFd_ >= 0) {
+            ::close(spillFd_);
+            ::unlink(spillPath_.c_str());
+        }
+    }
+
+    /**
+     * Starts a new game for the session; returns false if the session already exists.
+     */
+    bool create(uint64_t id) {
+        if (findEntry(id) != nullptr) return false;
+        uint32_t slot = allocateSlot();
+        sessions(slot) = { id, clock_, PackedGameState::pack(GameState()) };
+        insertEntry(id, slot);
+        return true;
+    }
+
+    /**
+     * Ends the session's game; returns false if there is no such session.
+     */
+    bool erase(uint64_t id) {
+        MapEntry* entry = findEntry(id);
+        if (entry == nullptr) return false;
+        if (entry->location & kSpilled) {
+            freeSpill_.push_back(entry->location & ~kSpilled);
+        }
+        else {
+            freeSlots_.push_back(entry->location);
+        }
+        eraseEntry(entry);
+        return true;
+    }
+
+    bool contains(uint64_t id) const { return findEntry(id) != nullptr; }
+
+    /**
+     * Replaces the session's game with the given state, creating the session if needed.
+     */
+    void assign(uint64_t id, const GameState& state) {
+        if (findEntry(id) == nullptr) create(id);
+        resident(id).state = PackedGameState::pack(state);
+    }
+
+    /**
+     * Calls fn(id, state) for every session, spilled ones included, in no particular order.
+     */
+    template <typename Fn>
+    void forEachSession(Fn fn) {
+        for (const auto& entry : map_) {
+            if (entry.location == kEmpty) continue;
+            if (entry.location & kSpilled) {
+                Session session;
+                readAll(&session, entry.location & ~kSpilled);
+                fn(entry.id, session.state.unpack());
+            }
+            else {
+                fn(entry.id, sessions(entry.location).state.unpack());
+            }
+        }
+    }
+
+    /**
+     * Plays the token in the session's game and returns the score it earned.
+     * Throws std::out_of_range for unknown sessions.
+     */
+    double step(uint64_t id, uint32_t token) {
+        Session& session = resident(id);
+        GameState state = session.state.unpack();
+        double score = state.step(token);
+        session.state = PackedGameState::pack(state);
+        return score;
+    }
+
+    /**
+     * Current state of the session's game. Throws std::out_of_range for unknown sessions.
+     */
+    GameState state(uint64_t id) { return resident(id).state.unpack(); }
+
+    /**
+     * Plays a batch of (session, token) requests as if step() were called for each in
+     * order, storing each request's score in scores if given. Distinct sessions are
+     * gathered kLanes at a time into a LaneBlock and advanced by the lane kernel; a
+     * session's later requests in the batch go to later rounds. Unknown sessions throw
+     * std::out_of_range before any game advances.
+     */
+    void stepBatch(const SessionToken* requests, size_t count, double* scores = nullptr) {
+        // Map entries and session records are prefetched in separate passes, so the misses overlap
+        batchSlots_.resize(count);
+        batchRound_.resize(count);
+        const size_t kAhead = 16;
+        for (size_t i = 0; i < count; ++i) {
+            if (i + kAhead < count && !map_.empty()) {
+                __builtin_prefetch(&map_[hash(requests[i + kAhead].session) & (map_.size() - 1)]);
+            }
+            const MapEntry* entry = findEntry(requests[i].session);
+            bool resident = entry != nullptr && !(entry->location & kSpilled);
+            batchSlots_[i] = resident ? entry->location : residentSlot(requests[i].session);
+        }
+
+        // Round r takes the r-th request of every session, so a round never repeats a session.
+        // A lastUse stamped by this batch names the session's previous request in it.
+        const uint64_t batchStart = clock_;
+        size_t rounds = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (i + kAhead < count) __builtin_prefetch(&sessions(batchSlots_[i + kAhead]), 1);
+            Session& session = sessions(batchSlots_[i]);
+            batchRound_[i] = session.lastUse > batchStart ? batchRound_[session.lastUse - batchStart - 1] + 1 : 0;
+            rounds = std::max<size_t>(rounds, batchRound_[i] + 1);
+            session.lastUse = ++clock_;
+        }
+        batchRoundStart_.assign(rounds + 1, 0);
+        for (size_t i = 0; i < count; ++i) ++batchRoundStart_[batchRound_[i] + 1];
+        std::partial_sum(batchRoundStart_.begin(), batchRoundStart_.end(), batchRoundStart_.begin());
+        batchOrder_.resize(count);
+        for (size_t i = 0; i < count; ++i) batchOrder_[batchRoundStart_[batchRound_[i]]++] = static_cast<uint32_t>(i);
+
+        const SimdKernels& kernels = simdKernels();
+        for (size_t round = 0, first = 0; round < rounds; ++round) {
+            // The fill above advanced each start to the end of its round
+            size_t end = batchRoundStart_[round];
+            for (; first < end; first += kLanes) {
+                size_t lanes = std::min(kLanes, end - first);
+                LaneBlock block;
+                uint32_t tokens[kLanes] = {};
+                uint8_t active[kLanes] = {};
+                for (size_t l = 0; l < lanes; ++l) {
+                    uint32_t request = batchOrder_[first + l];
+                    gatherLane(block, l, sessions(batchSlots_[request]).state);
+                    tokens[l] = requests[request].token;
+                    active[l] = 1;
+                }
+                kernels.stepLanes(block, tokens, active);
+                for (size_t l = 0; l < lanes; ++l) {
+                    uint32_t request = batchOrder_[first + l];
+                    scatterLane(block, l, sessions(batchSlots_[request]).state);
+                    if (scores != nullptr) scores[request] = block.lastScore[l];
+                }
+            }
+            first = end;
+        }
+    }
+
+    size_t size() const { return count_; }
+
+    size_t spilledCount() const { return spilled_; }
+
+    /**
+     * Moves sessions not accessed in the last max_idle operations to the spill file and
+     * returns how many were spilled. Throws std::logic_error without a spill file path.
+     */
+    size_t spillIdle(uint64_t max_idle) {
+        if (spillPath_.empty()) throw std::logic_error("session table has no spill file");
+        openSpillFile();
+        size_t moved = 0;
+        for (auto& entry : map_) {
+            if (entry.location == kEmpty || (entry.location & kSpilled)) continue;
+            Session& session = sessions(entry.location);
+            if (clock_ - session.lastUse <= max_idle) continue;
+            uint32_t record;
+            if (freeSpill_.empty()) {
+                record = spillRecords_++;
+            }
+            else {
+                record = freeSpill_.back();
+                freeSpill_.pop_back();
+            }
+            writeAll(&session, record);
+            freeSlots_.push_back(entry.location);
+            entry.location = record | kSpilled;
+            ++spilled_;
+            ++moved;
+        }
+        return moved;
+    }
+
+    /**
+     * Bytes held in memory: slabs, free lists and the id map.
+     */
+    size_t memoryBytes() const {
+        return slabs_.size() * kSlabSessions * sizeof(Session) + map_.capacity() * sizeof(MapEntry)
+            + (freeSlots_.capacity() + freeSpill_.capacity()) * sizeof(uint32_t)
+            + slabs_.capacity() * sizeof(slabs_[0]);
+    }
+
+private:
+    struct Session {
+        uint64_t id;
+        uint64_t lastUse;
+        PackedGameState state;
+    };
+
+    struct MapEntry {
+        uint64_t id;
+        uint32_t location;  // slab slot, or spill file record | kSpilled
+    };
+
+    static const uint32_t kEmpty = std::numeric_limits<uint32_t>::max();
+    static const uint32_t kSpilled = uint32_t(1) << 31;
+
+    static uint64_t hash(uint64_t id) {
+        id ^= id >> 33;
+        id *= 0xff51afd7ed558ccdULL;
+        id ^= id >> 33;
+        id *= 0xc4ceb9fe1a85ec53ULL;
+        return id ^ (id >> 33);
+    }
+
+    Session& sessions(uint32_t slot) { return slabs_[slot / kSlabSessions][slot % kSlabSessions]; }
+
+    uint32_t allocateSlot() {
+        if (freeSlots_.empty()) {
+            if ((slabs_.size() + 1) * kSlabSessions > kSpilled) throw std::length_error("session table is full");
+            slabs_.emplace_back(new Session[kSlabSessions]);
+            for (size_t i = kSlabSessions; i-- > 0;) {
+                freeSlots_.push_back(static_cast<uint32_t>((slabs_.size() - 1) * kSlabSessions + i));
+            }
+        }
+        uint32_t slot = freeSlots_.back();
+        freeSlots_.pop_back();
+        return slot;
+    }
+
+    const MapEntry* findEntry(uint64_t id) const {
+        if (map_.empty()) return nullptr;
+        size_t mask = map_.size() - 1;
+        for (size_t i = hash(id) & mask;; i = (i + 1) & mask) {
+            if (map_[i].location == kEmpty) return nullptr;
+            if (map_[i].id == id) return &map_[i];
+        }
+    }
+
+    MapEntry* findEntry(uint64_t id) {
+        return const_cast<MapEntry*>(static_cast<const SessionTable*>(this)->findEntry(id));
+    }
+
+    void insertEntry(uint64_t id, uint32_t location) {
+        // Keep the load factor at or below 1/2 so probe sequences stay short
+        if (2 * (count_ + 1) > map_.size()) {
+            std::vector<MapEntry> old(std::max<size_t>(16, 2 * map_.size()), MapEntry{ 0, kEmpty });
+            old.swap(map_);
+            for (const auto& entry : old) {
+                if (entry.location != kEmpty) place(entry);
+            }
+        }
+        place({ id, location });
+        ++count_;
+    }
+
+    void place(const MapEntry& entry) {
+        size_t mask = map_.size() - 1;
+        size_t i = hash(entry.id) & mask;
+        while (map_[i].location != kEmpty) i = (i + 1) & mask;
+        map_[i] = entry;
+    }
+
+    void eraseEntry(MapEntry* entry) {
+        if (entry->location & kSpilled) --spilled_;
+        size_t mask = map_.size() - 1;
+        size_t hole = entry - map_.data();
+        // Backward-shift deletion: move later entries of the probe run into the hole
+        for (size_t i = (hole + 1) & mask; map_[i].location != kEmpty; i = (i + 1) & mask) {
+            size_t home = hash(map_[i].id) & mask;
+            if (((i - home) & mask) >= ((i - hole) & mask)) {
+                map_[hole] = map_[i];
+                hole = i;
+            }
+        }
+        map_[hole].location = kEmpty;
+        --count_;
+    }
+
+    /**
+     * The session's in-memory record, read back from the spill file if needed.
+     */
+    Session& resident(uint64_t id) { return sessions(residentSlot(id)); }
+
+    uint32_t residentSlot(uint64_t id) {
+        MapEntry* entry = findEntry(id);
+        if (entry == nullptr) throw std::out_of_range("unknown session " + std::to_string(id));
+        if (entry->location & kSpilled) {
+            uint32_t record = entry->location & ~kSpilled;
+            uint32_t slot = allocateSlot();
+            readAll(&sessions(slot), record);
+            freeSpill_.push_back(record);
+            entry->location = slot;
+            --spilled_;
+        }
+        sessions(entry->location).lastUse = ++clock_;
+        return entry->location;
+    }
+
+    void openSpillFile() {
+        if (spillFd_ >= 0) return;
+        spillFd_ = ::open(spillPath_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (spillFd_ < 0) throw std::system_error(errno, std::generic_category(), "open " + spillPath_);
+    }
+
+    void writeAll(const Session* session, uint32_t record) {
+        off_t offset = static_cast<off_t>(record) * sizeof(Session);
+        if (::pwrite(spillFd_, session, sizeof(Session), offset) != static_cast<ssize_t>(sizeof(Session))) {
+            throw std::system_error(errno, std::generic_category(), "write " + spillPath_);
+        }
+    }
+
+    void readAll(Session* session, uint32_t record) {
+        off_t offset = static_cast<off_t>(record) * sizeof(Session);
+        if (::pread(spillFd_, session, sizeof(Session), offset) != static_cast<ssize_t>(sizeof(Session))) {
+            throw std::system_error(errno, std::generic_category(), "read " + spillPath_);
+        }
+    }
+
+    static void gatherLane(LaneBlock& block, size_t l, const PackedGameState& packed) {
+        const double inf = std::numeric_limits<double>::infinity();
+        uint64_t flags = packed.turnAndFlags >> PackedGameState::kFlagShift;
+        for (int box = 0; box < 4; ++box) block.absorbed[box][l] = packed.absorbed[box];
+        for (int g = 0; g < 2; ++g) {
+            for (int k = 0; k < 3; ++k) block.window[g][k][l] = packed.window[g][k];
+            bool seen = flags >> (4 + g) & 1;
+            block.windowSize[g][l] = flags >> (2 * g) & 3;
+            block.blueMin[g][l] = seen ? packed.blueMin[g] : inf;
+            block.blueMax[g][l] = seen ? packed.blueMax[g] : -inf;
+            block.scores[g][l] = packed.scores[g];
+        }
+        block.turn[l] = static_cast<int64_t>(packed.turnAndFlags & ((uint64_t(1) << PackedGameState::kFlagShift) - 1));
+        block.fingerprint[l] = packed.fingerprint;
+    }
+
+    static void scatterLane(const LaneBlock& block, size_t l, PackedGameState& packed) {
+        int64_t lowest = std::min(std::min(block.absorbed[0][l], block.absorbed[1][l]),
+            std::min(block.absorbed[2][l], block.absorbed[3][l]));
+        for (int box = 0; box < 4; ++box) packed.absorbed[box] = static_cast<uint32_t>(block.absorbed[box][l] - lowest);
+        packed.base += static_cast<uint64_t>(lowest);
+        uint64_t flags = 0;
+        for (int g = 0; g < 2; ++g) {
+            for (int k = 0; k < 3; ++k) packed.window[g][k] = static_cast<uint32_t>(block.window[g][k][l]);
+            bool seen = block.blueMin[g][l] != std::numeric_limits<double>::infinity();
+            if (seen) {
+                packed.blueMin[g] = static_cast<uint32_t>(block.blueMin[g][l]);
+                packed.blueMax[g] = static_cast<uint32_t>(block.blueMax[g][l]);
+            }
+            flags |= static_cast<uint64_t>(block.windowSize[g][l]) << (2 * g) | uint64_t(seen) << (4 + g);
+            packed.scores[g] = block.scores[g][l];
+        }
+        packed.turnAndFlags = static_cast<uint64_t>(block.turn[l]) | flags << PackedGameState::kFlagShift;
+        packed.fingerprint = block.fingerprint[l];
+    }
+
+    std::vector<std::unique_ptr<Session[]> > slabs_;
+    std::vector<uint32_t> freeSlots_;
+    std::vector<MapEntry> map_;
+    size_t count_ = 0;
+    size_t spilled_ = 0;
+    uint64_t clock_ = 0;
+    std::string spillPath_;
+    int spillFd_ = -1;
+    uint32_t spillRecords_ = 0;
+    std::vector<uint32_t> freeSpill_;
+    std::vector<uint32_t> batchSlots_;  // stepBatch scratch, kept to avoid reallocating
+    std::vector<uint32_t> batchRound_;
+    std::vector<uint32_t> batchRoundStart_;
+    std::vector<uint32_t> batchOrder_;
+};
+
+const size_t SessionTable::kSlabSessions;
+const uint32_t SessionTable::kEmpty;
+const uint32_t SessionTable::kSpilled;
+
+/**
+ * Operation recorded in the session write-ahead log.
+ */
+enum class WalOp : uint32_t { Create = 1, Step = 2, Erase = 3 };
+
+/**
+ * One log record. The check value covers the fields and the record's position in the
+ * log, so torn or stale tails are detected on recovery.
+ */
+struct WalRecord {
+    uint64_t session;
+    uint32_t token;
+    WalOp op;
+    uint64_t check;
+};
+
+static_assert(sizeof(WalRecord) == 24, "log records are written as raw bytes");
+
+/**
+ * Group commit policy: pending records are written and fsynced together once
+ * groupRecords are pending or the oldest has waited maxDelay, whichever comes first.
+ */
+struct WalConfig {
+    size_t groupRecords = 4096;
+    std::chrono::microseconds maxDelay{ 1000 };
+};
+
+/**
+ * Append-only log of session operations with group commit.
+ *
+ * append() only queues the record; a background thread writes queued records in
+ * batches and fsyncs each batch, so one fsync covers many tokens. Callers that need
+ * durability wait for their sequence number with waitDurable() or sync().
+ *
+ * A failed write is sticky: the log is cut back to its last durable record, nothing
+ * after it becomes durable, and every later append() and waitDurable() throws.
+ *
+ * A log file may start at any sequence number `first`, so a long log can be split into
+ * segments that continue each other's numbering.
+ */
+class WriteAheadLog {
+public:
+    /**
+     * Opens or creates the log whose first record has sequence position `first`,
+     * dropping a torn tail that a crash may have left.
+     */
+    WriteAheadLog(const std::string& path, const WalConfig& config = WalConfig(), uint64_t first = 0)
+        : path_(path), config_(config), first_(first) {
+        uint64_t intact = replay(path, std::numeric_limits<uint64_t>::max(), [](const WalRecord&) {}, first);
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+        if (fd_ < 0) throw std::system_error(errno, std::generic_category(), "open " + path);
+        off_t end = static_cast<off_t>((intact - first) * sizeof(WalRecord));
+        if (::ftruncate(fd_, end) != 0 || ::lseek(fd_, end, SEEK_SET) != end) {
+            int error = errno;
+            ::close(fd_);
+            throw std::system_error(error, std::generic_category(), "truncate " + path);
+        }
+        appended_ = durable_ = intact;
+        flusher_ = std::thread(&WriteAheadLog::flushLoop, this);
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    /**
+     * Commits what is still pending and closes the log.
+     */
+    ~WriteAheadLog() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_one();
+        flusher_.join();
+        ::close(fd_);
+    }
+
+    /**
+     * Queues a record and returns its sequence number (the log length including it).
+     * Throws std::system_error once a write has failed.
+     */
+    uint64_t append(WalOp op, uint64_t session, uint32_t token = 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error_ != 0) throw std::system_error(error_, std::generic_category(), "write " + path_);
+        if (pending_.empty()) oldest_ = std::chrono::steady_clock::now();
+        WalRecord record{ session, token, op, 0 };
+        record.check = checksum(record, appended_);
+        pending_.push_back(record);
+        if (pending_.size() == 1 || pending_.size() >= config_.groupRecords) wake_.notify_one();
+        return ++appended_;
+    }
+
+    /**
+     * Blocks until the record with the given sequence number is on stable storage.
+     * Throws std::system_error if the log could not be written.
+     */
+    void waitDurable(uint64_t sequence) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        durableChanged_.wait(lock, [this, sequence] { return durable_ >= sequence || error_ != 0; });
+        if (error_ != 0) throw std::system_error(error_, std::generic_category(), "write " + path_);
+    }
+
+    /**
+     * Commits all queued records now, without waiting for the group to fill.
+     */
+    void sync() {
+        uint64_t sequence;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sequence = appended_;
+            syncRequested_ = true;
+        }
+        wake_.notify_one();
+        waitDurable(sequence);
+    }
+
+    uint64_t appended() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return appended_;
+    }
+
+    uint64_t durable() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return durable_;
+    }
+
+    /**
+     * Number of group commits (fsyncs) so far.
+     */
+    uint64_t commits() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return commits_;
+    }
+
+    /**
+     * Calls fn for every intact record from sequence position `from` (0-based) on and
+     * returns the position after the last intact record, stopping at the first torn or
+     * stale one. The file's first record has position `first`.
+     */
+    template <typename Fn>
+    static uint64_t replay(const std::string& path, uint64_t from, Fn fn, uint64_t first = 0) {
+        std::ifstream in(path, std::ios::binary);
+        std::vector<WalRecord> buffer(4096);
+        uint64_t position = first;
+        while (in) {
+            in.read(reinterpret_cast<char*>(buffer.data()), buffer.size() * sizeof(WalRecord));
+            size_t count = static_cast<size_t>(in.gcount()) / sizeof(WalRecord);
+            for (size_t i = 0; i < count; ++i, ++position) {
+                if (buffer[i].check != checksum(buffer[i], position)) return position;
+                if (position >= from) fn(buffer[i]);
+            }
+        }
+        return position;
+    }
+
+private:
+    static uint64_t checksum(const WalRecord& record, uint64_t position) {
+        uint64_t h = position * 0x9e3779b97f4a7c15ULL ^ record.session;
+        h ^= (uint64_t(record.token) << 32 | static_cast<uint32_t>(record.op)) + 0x632be59bd9b4e019ULL + (h << 6) + (h >> 2);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        return h ^ (h >> 33);
+    }
+
+    void flushLoop() {
+        std::vector<WalRecord> batch;
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            wake_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+            if (pending_.empty()) return;
+            wake_.wait_until(lock, oldest_ + config_.maxDelay,
+                [this] { return stop_ || syncRequested_ || pending_.size() >= config_.groupRecords; });
+            batch.swap(pending_);
+            syncRequested_ = false;
+            uint64_t sequence = appended_;
+            if (error_ != 0) {
+                batch.clear();  // after a failure nothing may follow the last durable record
+                continue;
+            }
+            lock.unlock();
+            int error = writeAndSync(batch);
+            batch.clear();
+            lock.lock();
+            if (error != 0) {
+                error_ = error;
+                // Best effort: drop a partly written batch so the file ends on a durable record
+                off_t end = static_cast<off_t>((durable_ - first_) * sizeof(WalRecord));
+                if (::ftruncate(fd_, end) == 0) ::lseek(fd_, end, SEEK_SET);
+            }
+            else {
+                durable_ = sequence;
+                ++commits_;
+            }
+            durableChanged_.notify_all();
+        }
+    }
+
+    int writeAndSync(const std::vector<WalRecord>& batch) {
+        const char* data = reinterpret_cast<const char*>(batch.data());
+        size_t left = batch.size() * sizeof(WalRecord);
+        while (left > 0) {
+            ssize_t written = ::write(fd_, data, left);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return errno;
+            }
+            data += written;
+            left -= static_cast<size_t>(written);
+        }
+        return ::fdatasync(fd_) == 0 ? 0 : errno;
+    }
+
+    std::string path_;
+    WalConfig config_;
+    uint64_t first_;
+    int fd_ = -1;
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;            // flusher: records pending, sync requested or stop
+    std::condition_variable durableChanged_;  // waiters: durable_ or error_ changed
+    std::vector<WalRecord> pending_;
+    std::chrono::steady_clock::time_point oldest_;
+    uint64_t appended_ = 0;
+    uint64_t durable_ = 0;
+    uint64_t commits_ = 0;
+    int error_ = 0;
+    bool syncRequested_ = false;
+    bool stop_ = false;
+    std::thread flusher_;
+};
+
+/**
+ * SessionTable whose operations survive restarts: each operation is logged to a
+ * WriteAheadLog, and checkpoint() writes a snapshot so recovery only replays the log
+ * records after it. Files live in the given directory.
+ *
+ * The log is split into segments named after their first sequence position. A
+ * checkpoint starts a new segment at the position it covers and deletes the older
+ * ones, so the log only holds the records since the last snapshot.
+ *
+ * A log from before segments (sessions.wal) is taken over as the segment at 0.
+ * Version 1 snapshots predate game fingerprints and only exist next to such a log,
+ * which was never shortened; they are migrated by ignoring them and replaying it
+ * from 0. The next checkpoint writes the current version.
+ */
+class DurableSessionTable {
+public:
+    /**
+     * Recovers the sessions from the directory's snapshot and log, if there are any.
+     * Throws std::runtime_error if the log segments do not continue the snapshot.
+     */
+    explicit DurableSessionTable(const std::string& directory, const WalConfig& config = WalConfig())
+        : directory_(directory), snapshotPath_(directory + "/sessions.snapshot"), config_(config) {
+        std::string legacy = directory + "/sessions.wal";
+        if (::access(legacy.c_str(), F_OK) == 0
+            && std::rename(legacy.c_str(), logSegmentPath(directory, 0).c_str()) != 0) {
+            throw std::system_error(errno, std::generic_category(), "rename " + legacy);
+        }
+        bool versionOne = false;
+        uint64_t covered = loadSnapshot(versionOne);
+        std::vector<uint64_t> segments = logSegments(directory);
+        uint64_t next = segments.empty() ? covered : segments.front();
+        if (next > covered) {
+            throw std::runtime_error(versionOne
+                ? "version 1 snapshot needs the whole log, which was rotated; rebuild " + directory
+                : "log segments in " + directory + " do not reach back to the snapshot");
+        }
+        for (uint64_t first : segments) {
+            if (first != next) {
+                throw std::runtime_error("log segment before " + logSegmentPath(directory, first) + " is incomplete");
+            }
+            next = WriteAheadLog::replay(logSegmentPath(directory, first), covered,
+                [this](const WalRecord& record) { apply(record); }, first);
+        }
+        logFirst_ = segments.empty() ? covered : segments.back();
+        log_.reset(new WriteAheadLog(logSegmentPath(directory, logFirst_), config, logFirst_));
+    }
+
+    /**
+     * Path of the log segment starting at sequence position `first`.
+     */
+    static std::string logSegmentPath(const std::string& directory, uint64_t first) {
+        char name[48];
+        std::snprintf(name, sizeof(name), "/sessions.wal.%020llu", static_cast<unsigned long long>(first));
+        return directory + name;
+    }
+
+    /**
+     * First sequence positions of the directory's log segments, in order.
+     */
+    static std::vector<uint64_t> logSegments(const std::string& directory) {
+        std::vector<uint64_t> segments;
+        DIR* dir = ::opendir(directory.c_str());
+        if (dir == nullptr) throw std::system_error(errno, std::generic_category(), "opendir " + directory);
+        const std::string prefix = "sessions.wal.";
+        while (const dirent* entry = ::readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() == prefix.size() + 20 && name.compare(0, prefix.size(), prefix) == 0
+                && name.find_first_not_of("0123456789", prefix.size()) == std::string::npos) {
+                segments.push_back(std::stoull(name.substr(prefix.size())));
+            }
+        }
+        ::closedir(dir);
+        std::sort(segments.begin(), segments.end());
+        return segments;
+    }
+
+    bool create(uint64_t id) {
+        if (!sessions_.create(id)) return false;
+        log_->append(WalOp::Create, id);
+        return true;
+    }
+
+    bool erase(uint64_t id) {
+        if (!sessions_.erase(id)) return false;
+        log_->append(WalOp::Erase, id);
+        return true;
+    }
+
+    /**
+     * Plays the token and logs it; the step is durable after the next group commit.
+     */
+    double step(uint64_t id, uint32_t token) {
+        double score = sessions_.step(id, token);
+        log_->append(WalOp::Step, id, token);
+        return score;
+    }
+
+    /**
+     * Waits until every operation so far is durable.
+     */
+    void sync() { log_->sync(); }
+
+    /**
+     * Writes a snapshot of all sessions covering the log so far, replacing the previous
+     * one atomically, then continues the log in a new segment and deletes the covered
+     * ones. Returns the number of log records it covers.
+     */
+    uint64_t checkpoint() {
+        // The log must hold every record the snapshot covers, or later records would be misnumbered
+        log_->sync();
+        uint64_t covered = log_->appended();
+        std::string temporary = snapshotPath_ + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            uint64_t count = sessions_.size();
+            out.write(reinterpret_cast<const char*>(&kSnapshotMagic), 4);
+            out.write(reinterpret_cast<const char*>(&kSnapshotVersion), 4);
+            out.write(reinterpret_cast<const char*>(&covered), 8);
+            out.write(reinterpret_cast<const char*>(&count), 8);
+            sessions_.forEachSession([&out](uint64_t id, const GameState& state) {
+                PackedGameState packed = PackedGameState::pack(state);
+                out.write(reinterpret_cast<const char*>(&id), 8);
+                out.write(reinterpret_cast<const char*>(&packed), sizeof(packed));
+            });
+            if (!out) throw std::runtime_error("cannot write snapshot " + temporary);
+        }
+        syncFile(temporary);
+        if (std::rename(temporary.c_str(), snapshotPath_.c_str()) != 0) {
+            throw std::system_error(errno, std::generic_category(), "rename " + temporary);
+        }
+        syncFile(directory_);
+
+        // Only once the snapshot is durable may the records it covers go
+        if (covered != logFirst_) {
+            std::unique_ptr<WriteAheadLog> next(
+                new WriteAheadLog(logSegmentPath(directory_, covered), config_, covered));
+            log_.swap(next);
+            logFirst_ = covered;
+        }
+        for (uint64_t first : logSegments(directory_)) {
+            if (first < covered) std::remove(logSegmentPath(directory_, first).c_str());
+        }
+        return covered;
+    }
+
+    SessionTable& sessions() { return sessions_; }
+
+    const WriteAheadLog& log() const { return *log_; }
+
+private:
+    static const uint32_t kSnapshotMagic = 0x4e535341;  // "ASSN"
+    static const uint32_t kSnapshotVersion = 2;
+
+    static void syncFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || ::fsync(fd) != 0) {
+            int error = errno;
+            if (fd >= 0) ::close(fd);
+            throw std::system_error(error, std::generic_category(), "fsync " + path);
+        }
+        ::close(fd);
+    }
+
+    /**
+     * Loads the snapshot, if any, and returns the number of log records it covers.
+     * A version 1 snapshot is skipped and covers nothing.
+     */
+    uint64_t loadSnapshot(bool& versionOne) {
+        std::ifstream in(snapshotPath_, std::ios::binary);
+        if (!in) return 0;
+        uint32_t magic = 0, version = 0;
+        uint64_t covered = 0, count = 0;
+        in.read(reinterpret_cast<char*>(&magic), 4);
+        in.read(reinterpret_cast<char*>(&version), 4);
+        in.read(reinterpret_cast<char*>(&covered), 8);
+        in.read(reinterpret_cast<char*>(&count), 8);
+        versionOne = in && magic == kSnapshotMagic && version == 1;
+        if (versionOne) return 0;
+        if (!in || magic != kSnapshotMagic || version != kSnapshotVersion) {
+            throw std::runtime_error("not a session snapshot: " + snapshotPath_);
+        }
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t id;
+            PackedGameState packed;
+            in.read(reinterpret_cast<char*>(&id), 8);
+            in.read(reinterpret_cast<char*>(&packed), sizeof(packed));
+            if (!in) throw std::runtime_error("truncated session snapshot " + snapshotPath_);
+            sessions_.assign(id, packed.unpack());
+        }
+        return covered;
+    }
+
+    void apply(const WalRecord& record) {
+        switch (record.op) {
+        case WalOp::Create:
+            sessions_.create(record.session);
+            break;
+        case WalOp::Step:
+            sessions_.step(record.session, record.token);
+            break;
+        case WalOp::Erase:
+            sessions_.erase(record.session);
+            break;
+        }
+    }
+
+    std::string directory_;
+    std::string snapshotPath_;
+    WalConfig config_;
+    SessionTable sessions_;
+    uint64_t logFirst_ = 0;  // first sequence position of the open segment
+    std::unique_ptr<WriteAheadLog> log_;
+};
+
+const uint32_t DurableSessionTable::kSnapshotMagic;
+const uint32_t DurableSessionTable::kSnapshotVersion;
+
+/**
+ * Bounded lock-free queue for one producer thread and one consumer thread.
+ * A side that finds the queue full or empty yields for a few rounds, then blocks until
+ * the other side makes progress, so an idle stream does not burn its threads' cores.
+ *
+ * The fast path stays free of full fences: a side only looks for sleepers with a plain
+ * load after its update. A wake-up lost to store reordering in that window is caught by
+ * the sleeper's 1 ms timeout, which costs far less than a fence per item.
+ */
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) : capacity_(capacity + 1), items_(new T[capacity + 1]) {}
+
+    void push(const T& item) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t next = tail + 1 == capacity_ ? 0 : tail + 1;
+        waitUntil([&] { return next != head_.load(std::memory_order_acquire); });
+        items_[tail] = item;
+        tail_.store(next, std::memory_order_release);
+        wakeWaiters();
+    }
+
+    /**
+     * Takes the next item; returns false once the queue is closed and drained.
+     */
+    bool pop(T& item) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        waitUntil([&] {
+            return head != tail_.load(std::memory_order_acquire) || closed_.load(std::memory_order_acquire);
+        });
+        // Items pushed before close() are visible once closed_ is
+        if (head == tail_.load(std::memory_order_acquire)) return false;
+        item = items_[head];
+        head_.store(head + 1 == capacity_ ? 0 : head + 1, std::memory_order_release);
+        wakeWaiters();
+        return true;
+    }
+
+    /**
+     * Called by the producer after its last push.
+     */
+    void close() {
+        closed_.store(true, std::memory_order_release);
+        wakeWaiters();
+    }
+
+private:
+    static const int kSpins = 64;
+
+    template <typename Ready>
+    void waitUntil(Ready ready) {
+        for (int spin = 0; spin < kSpins; ++spin) {
+            if (ready()) return;
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        waiters_.fetch_add(1);
+        while (!wake_.wait_for(lock, std::chrono::milliseconds(1), ready)) {
+        }
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void wakeWaiters() {
+        if (waiters_.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            wake_.notify_all();
+        }
+    }
+
+    // head_ and tail_ are 64 bytes apart, so they never share a cache line. Padding by
+    // hand instead of alignas keeps plain operator new valid before C++17.
+    size_t capacity_;
+    std::unique_ptr<T[]> items_;
+    std::atomic<size_t> head_{ 0 };
+    char headPadding_[64];
+    std::atomic<size_t> tail_{ 0 };
+    char tailPadding_[64];
+    std::atomic<bool> closed_{ false };
+    std::atomic<int> waiters_{ 0 };
+    std::mutex mutex_;
+    std::condition_variable wake_;
+};
+
+template <typename T>
+const int SpscQueue<T>::kSpins;
+
+/**
+ * Online game split into a pipeline: the thread calling push() only assigns tokens to
+ * boxes, one scorer thread per box computes that box's scores, and a merger thread
+ * adds them to the players' totals in turn order. Summing in turn order keeps the
+ * result identical to play().
+ */
+class StreamingGame {
+public:
+    explicit StreamingGame(size_t queue_capacity = 4096) : order_(queue_capacity) {
+        for (int box = 0; box < 4; ++box) {
+            tokens_[box].reset(new SpscQueue<uint32_t>(queue_capacity));
+            scores_[box].reset(new SpscQueue<double>(queue_capacity));
+        }
+        // If a thread cannot be started, the ones already running must not outlive the game
+        try {
+            for (int box = 0; box < 4; ++box) {
+                scorers_[box] = std::thread(&StreamingGame::score, this, box);
+            }
+            merger_ = std::thread(&StreamingGame::merge, this);
+        }
+        catch (...) {
+            stop();
+            throw;
+        }
+    }
+
+    StreamingGame(const StreamingGame&) = delete;
+    StreamingGame& operator=(const StreamingGame&) = delete;
+
+    ~StreamingGame() { finish(); }
+
+    /**
+     * Assigns the token to the lightest box and hands it to that box's scorer.
+     */
+    void push(uint32_t token) {
+        int box = assignment_.selectBox();
+        assignment_.absorbed[box] += token;
+        if (assignment_.absorbed[box] >= GameState::kRebaseLimit) assignment_.normalize();
+        order_.push(static_cast<uint8_t>(box));
+        tokens_[box]->push(token);
+    }
+
+    void push(const uint32_t* tokens, size_t count) {
+        for (size_t i = 0; i < count; ++i) push(tokens[i]);
+    }
+
+    /**
+     * Ends the stream, waits for the pipeline to drain and returns the final scores.
+     */
+    GameResult finish() {
+        if (!finished_) {
+            finished_ = true;
+            stop();
+        }
+        return result_;
+    }
+
+private:
+    /**
+     * Closes the input queues and joins the threads that were started.
+     */
+    void stop() {
+        order_.close();
+        for (auto& queue : tokens_) queue->close();
+        for (auto& scorer : scorers_) {
+            if (scorer.joinable()) scorer.join();
+        }
+        if (merger_.joinable()) merger_.join();
+    }
+
+    void score(int box) {
+        // A private GameState reuses the scalar scoring; only this box's part is used
+        GameState state;
+        SpscQueue<uint32_t>& in = *tokens_[box];
+        SpscQueue<double>& out = *scores_[box];
+        uint32_t token;
+        while (in.pop(token)) {
+            out.push(state.absorb(box, token));
+            state.absorbed[box] = 0;
+        }
+        out.close();
+    }
+
+    void merge() {
+        double totals[2] = { 0.0, 0.0 };
+        uint64_t turn = 0;
+        uint8_t box;
+        double score = 0.0;
+        while (order_.pop(box)) {
+            scores_[box]->pop(score);
+            result_.fingerprint = foldTurn(result_.fingerprint, turn, box, score);
+            totals[turn++ % 2] += score;
+        }
+        result_.scoreA = totals[0];
+        result_.scoreB = totals[1];
+    }
+
+    GameState assignment_;
+    SpscQueue<uint8_t> order_;  // box of each turn, for the merger
+    std::unique_ptr<SpscQueue<uint32_t> > tokens_[4];
+    std::unique_ptr<SpscQueue<double> > scores_[4];
+    std::thread scorers_[4];
+    std::thread merger_;
+    GameResult result_;
+    bool finished_ = false;
+};
+
+/**
+ * Plays a whole game through the streaming pipeline.
+ */
+GameResult playStreaming(const uint32_t* input_weights, size_t count, size_t queue_capacity = 4096) {
+    StreamingGame game(queue_capacity);
+    game.push(input_weights, count);
+    return game.finish();
+}
+
+/**
+ * Result of the leave-one-out analysis: how the final scores change if one token is
+ * removed from the input.
+ */
+struct LeaveOneOutAnalysis {
+    GameResult full;             // scores with all tokens
+    std::vector<double> deltaA;  // per position: score of A without that token minus full.scoreA
+    std::vector<double> deltaB;
+    uint64_t simulatedTurns = 0;  // turns played beyond the shared prefixes, n * (n - 1) naively
+};
+
+/**
+ * Computes the score deltas of removing each token in turn, sharing work between the
+ * n games instead of replaying each one.
+ *
+ * The game without token i starts from the full game's state before token i, taken from
+ * forward checkpoints, and is simulated until its suffix is known to repeat one
+ * already played:
+ * - Once its normalized boxes equal the full game's, both play identical turns with the
+ *   players swapped, so the rest of its scores are the full game's suffix sums of the
+ *   other parity. This needs each box of the full game to be w_i / 4 heavier, so it is
+ *   only checked for token weights divisible by 4.
+ * - Games without two equal tokens consumed the same tokens once past the later one, and
+ *   often merge a few hundred turns later. Each game keeps a trail of sampled states
+ *   for the next removal of an equal token in its chunk; on a match, that game's
+ *   remaining scores are reused.
+ * Suffixes that never merge are simulated to the end, so inputs over a wide range of
+ * token weights approach n^2 / 2 turns. Chunks of positions are spread over threads.
+ * Because suffix scores are added in one go, results can differ from a full replay in
+ * the last bits.
+ */
+LeaveOneOutAnalysis leaveOneOut(const std::vector<uint32_t>& input_weights, unsigned threads = defaultThreadCount()) {
+    const size_t n = input_weights.size();
+    LeaveOneOutAnalysis analysis;
+    analysis.deltaA.resize(n);
+    analysis.deltaB.resize(n);
+
+    // suffix[p][t]: scores of turns t and later that the full game credits to player p
+    std::vector<double> suffix[2] = { std::vector<double>(n + 1, 0.0), std::vector<double>(n + 1, 0.0) };
+    {
+        GameState state;
+        std::vector<double> turnScores(n);
+        for (size_t t = 0; t < n; ++t) turnScores[t] = state.step(input_weights[t]);
+        analysis.full.scoreA = state.scores[0];
+        analysis.full.scoreB = state.scores[1];
+        for (size_t t = n; t-- > 0;) {
+            suffix[0][t] = suffix[0][t + 1] + (t % 2 == 0 ? turnScores[t] : 0.0);
+            suffix[1][t] = suffix[1][t + 1] + (t % 2 == 1 ? turnScores[t] : 0.0);
+        }
+    }
+
+    // Sampled states of one game, at positions (next token index) that are multiples of kStride
+    struct Trail {
+        size_t first = 0;
+        std::vector<GameState> states;    // normalized
+        std::vector<GameResult> remaining;  // scores the game earned after each sample
+    };
+    // Large chunks let more removals find an earlier equal token; trails are only kept for
+    // equal tokens at most kMaxGap apart, as farther ones rarely merge
+    const size_t kChunk = std::max<size_t>(1024, std::min<size_t>(65536, n / (4 * std::max(1u, threads))));
+    const size_t kStride = 16, kTrailLength = 2048, kMaxGap = 4096;
+    const size_t kNone = std::numeric_limits<size_t>::max();
+
+    IndexedReplay checkpoints(input_weights, kChunk);
+    std::atomic<size_t> next{ 0 };
+    std::atomic<uint64_t> simulated{ 0 };
+    parallelChunks((n + kChunk - 1) / kChunk, threads, [&](size_t, size_t, unsigned) {
+        uint64_t turns = 0;
+        std::vector<size_t> previousEqual(kChunk), nextEqual(kChunk);
+        std::vector<std::shared_ptr<Trail> > trails(kChunk);
+        std::unordered_map<uint32_t, size_t> seen;
+        for (size_t begin = next.fetch_add(kChunk); begin < n; begin = next.fetch_add(kChunk)) {
+            size_t end = std::min(n, begin + kChunk);
+            seen.clear();
+            for (size_t i = begin; i < end; ++i) {
+                auto found = seen.find(input_weights[i]);
+                previousEqual[i - begin] = found == seen.end() ? kNone : found->second;
+                nextEqual[i - begin] = kNone;
+                if (found != seen.end()) nextEqual[found->second - begin] = i;
+                seen[input_weights[i]] = i;
+            }
+
+            GameState prefix = checkpoints.stateAt(begin);
+            for (size_t i = begin; i < end; ++i) {
+                std::shared_ptr<Trail> source;
+                if (previousEqual[i - begin] != kNone) source.swap(trails[previousEqual[i - begin] - begin]);
+                size_t recordFrom = nextEqual[i - begin] == kNone || nextEqual[i - begin] - i > kMaxGap
+                    ? kNone : nextEqual[i - begin] + 1;
+                std::shared_ptr<Trail> trail = recordFrom == kNone ? nullptr : std::make_shared<Trail>();
+
+                bool checkFull = input_weights[i] % 4 == 0;
+                GameState without = prefix;
+                GameState full = prefix;
+                if (checkFull) full.step(input_weights[i]);
+                GameResult result;
+                size_t merged = 0;  // position where the source's trail was matched
+                for (size_t j = i + 1;; ++j) {
+                    bool sample = j % kStride == 0;
+                    if (checkFull || sample) without.normalize();
+                    if (checkFull) {
+                        full.normalize();
+                        // Turn j - 1 of this game is turn j of the full game
+                        if (sameBoxes(without, full)) {
+                            result.scoreA = without.scores[0] + suffix[1][j];
+                            result.scoreB = without.scores[1] + suffix[0][j];
+                            break;
+                        }
+                    }
+                    if (sample && source != nullptr && j >= source->first
+                        && (j - source->first) / kStride < source->states.size()) {
+                        size_t s = (j - source->first) / kStride;
+                        if (sameBoxes(without, source->states[s])) {
+                            result.scoreA = without.scores[0] + source->remaining[s].scoreA;
+                            result.scoreB = without.scores[1] + source->remaining[s].scoreB;
+                            merged = j;
+                            break;
+                        }
+                    }
+                    if (sample && trail != nullptr && j >= recordFrom && j < recordFrom + kTrailLength) {
+                        if (trail->states.empty()) trail->first = j;
+                        trail->states.push_back(without);
+                    }
+                    if (j == n) {
+                        result.scoreA = without.scores[0];
+                        result.scoreB = without.scores[1];
+                        break;
+                    }
+                    without.step(input_weights[j]);
+                    if (checkFull) full.step(input_weights[j]);
+                    ++turns;
+                }
+                if (trail != nullptr) {
+                    for (const auto& state : trail->states) {
+                        trail->remaining.push_back({ result.scoreA - state.scores[0], result.scoreB - state.scores[1] });
+                    }
+                    // After merging, this game's states and remaining scores are its source's
+                    for (size_t s = merged == 0 ? 0 : (merged - source->first) / kStride;
+                         merged != 0 && s < source->states.size(); ++s) {
+                        size_t j = source->first + s * kStride;
+                        if (j < recordFrom) continue;
+                        if (j >= recordFrom + kTrailLength) break;
+                        if (trail->states.empty()) trail->first = j;
+                        trail->states.push_back(source->states[s]);
+                        trail->remaining.push_back(source->remaining[s]);
+                    }
+                    trails[i - begin] = trail;
+                }
+                analysis.deltaA[i] = result.scoreA - analysis.full.scoreA;
+                analysis.deltaB[i] = result.scoreB - analysis.full.scoreB;
+                prefix.step(input_weights[i]);
+            }
+        }
+        simulated += turns;
+    });
+    analysis.simulatedTurns = simulated;
+    return analysis;
+}
+
+/**
+ * Rearrangement of a token ordering: swap the tokens at from and to, or take the token
+ * at from out and reinsert it at to.
+ */
+struct OrderingMove {
+    enum Kind { Swap, Insert } kind;
+    size_t from;
+    size_t to;
+};
+
+/**
+ * One token ordering under local search, with checkpoints of its game every kInterval
+ * turns so that moves are evaluated incrementally.
+ *
+ * A move only changes tokens between its two positions. Evaluation replays from the
+ * checkpoint before the first one, and past the second compares with the checkpoints:
+ * both orderings have then consumed the same tokens, and once their boxes match the
+ * rest of the game is the same, so its scores are taken from the current game.
+ * Scores carried over that way can differ from a full replay in the last bits.
+ */
+class OrderingChain {
+public:
+    static const size_t kInterval = 64;
+
+    explicit OrderingChain(std::vector<uint32_t> tokens) : tokens_(std::move(tokens)) {
+        GameState state;
+        for (size_t t = 0; t <= tokens_.size(); ++t) {
+            if (t % kInterval == 0) {
+                state.normalize();
+                checkpoints_.push_back(state);
+            }
+            if (t < tokens_.size()) state.step(tokens_[t]);
+        }
+        final_.scoreA = state.scores[0];
+        final_.scoreB = state.scores[1];
+    }
+
+    const std::vector<uint32_t>& tokens() const { return tokens_; }
+
+    double margin() const { return final_.scoreA - final_.scoreB; }
+
+    /**
+     * Margin of player A after the move, which stays pending until accept().
+     */
+    double evaluate(const OrderingMove& move) {
+        pending_ = move;
+        size_t low = std::min(move.from, move.to), high = std::max(move.from, move.to);
+        size_t c = low / kInterval;
+        GameState state = checkpoints_[c];
+        scratch_.clear();
+        mergedAt_ = checkpoints_.size();
+        for (size_t t = c * kInterval; t < tokens_.size(); ++t) {
+            state.step(tokenAfter(move, t));
+            size_t next = t + 1;
+            if (next % kInterval != 0) continue;
+            state.normalize();
+            if (next > high && sameBoxes(state, checkpoints_[next / kInterval])) {
+                mergedAt_ = next / kInterval;
+                break;
+            }
+            scratch_.push_back(state);
+        }
+        if (mergedAt_ < checkpoints_.size()) {
+            const GameState& merged = checkpoints_[mergedAt_];
+            offset_.scoreA = state.scores[0] - merged.scores[0];
+            offset_.scoreB = state.scores[1] - merged.scores[1];
+            candidate_.scoreA = final_.scoreA + offset_.scoreA;
+            candidate_.scoreB = final_.scoreB + offset_.scoreB;
+        }
+        else {
+            candidate_.scoreA = state.scores[0];
+            candidate_.scoreB = state.scores[1];
+        }
+        return candidate_.scoreA - candidate_.scoreB;
+    }
+
+    /**
+     * Applies the move passed to the last evaluate().
+     */
+    void accept() {
+        size_t c = std::min(pending_.from, pending_.to) / kInterval;
+        std::copy(scratch_.begin(), scratch_.end(), checkpoints_.begin() + c + 1);
+        for (size_t k = mergedAt_; k < checkpoints_.size(); ++k) {
+            checkpoints_[k].scores[0] += offset_.scoreA;
+            checkpoints_[k].scores[1] += offset_.scoreB;
+        }
+        const OrderingMove& m = pending_;
+        if (m.kind == OrderingMove::Swap) {
+            std::swap(tokens_[m.from], tokens_[m.to]);
+        }
+        else if (m.from < m.to) {
+            std::rotate(tokens_.begin() + m.from, tokens_.begin() + m.from + 1, tokens_.begin() + m.to + 1);
+        }
+        else {
+            std::rotate(tokens_.begin() + m.to, tokens_.begin() + m.from, tokens_.begin() + m.from + 1);
+        }
+        final_ = candidate_;
+    }
+
+private:
+    uint32_t tokenAfter(const OrderingMove& m, size_t t) const {
+        if (m.kind == OrderingMove::Swap) {
+            return t == m.from ? tokens_[m.to] : t == m.to ? tokens_[m.from] : tokens_[t];
+        }
+        if (t == m.to) return tokens_[m.from];
+        if (m.from < m.to && t >= m.from && t < m.to) return tokens_[t + 1];
+        if (m.to < m.from && t > m.to && t <= m.from) return tokens_[t - 1];
+        return tokens_[t];
+    }
+
+    std::vector<uint32_t> tokens_;
+    std::vector<GameState> checkpoints_;  // normalized states after k * kInterval turns
+    GameResult final_;
+    OrderingMove pending_{ OrderingMove::Swap, 0, 0 };
+    std::vector<GameState> scratch_;  // checkpoints of the pending ordering before the merge
+    size_t mergedAt_ = 0;
+    GameResult offset_;
+    GameResult candidate_;
+};
+
+const size_t OrderingChain::kInterval;
+
+struct OrderingSearchConfig {
+    size_t chains = defaultThreadCount();
+    uint64_t iterations = 100000;  // per chain
+    double startTemperature = 0.0;  // 0 derives it from the margin changes of random moves
+    double endTemperature = 0.0;    // 0 uses startTemperature / 1000
+    uint32_t seed = 1;
+};
+
+struct OrderingSearchResult {
+    std::vector<uint32_t> bestOrder;
+    double initialMargin = 0.0;
+    double bestMargin = 0.0;  // from a full replay of bestOrder
+    uint64_t evaluations = 0;
+    double evaluationsPerSecond = 0.0;
+};
+
+/**
+ * Searches for the ordering of the given tokens that maximizes player A's margin over B,
+ * with simulated annealing over swap and insert moves. Independent chains with different
+ * seeds, all starting from the given order, are spread over at most defaultThreadCount()
+ * threads; the best ordering any chain visited is returned.
+ */
+OrderingSearchResult optimizeOrdering(const std::vector<uint32_t>& tokens, const OrderingSearchConfig& config) {
+    OrderingSearchResult result;
+    GameResult initial = playState(tokens.data(), tokens.size());
+    result.initialMargin = result.bestMargin = initial.scoreA - initial.scoreB;
+    result.bestOrder = tokens;
+    if (tokens.size() < 2) return result;
+
+    std::mutex bestMutex;
+    std::atomic<uint64_t> evaluations{ 0 };
+    auto start = std::chrono::steady_clock::now();
+    unsigned threads = static_cast<unsigned>(std::min<size_t>(config.chains, defaultThreadCount()));
+    parallelChunks(config.chains, threads, [&](size_t first, size_t last, unsigned) {
+        for (size_t chainIndex = first; chainIndex < last; ++chainIndex) {
+            std::mt19937_64 rng(config.seed * 0x9e3779b97f4a7c15ULL + chainIndex);
+            std::uniform_int_distribution<size_t> position(0, tokens.size() - 1);
+            std::uniform_real_distribution<double> uniform(0.0, 1.0);
+            OrderingChain chain(tokens);
+            auto randomMove = [&] {
+                OrderingMove move{ rng() % 2 ? OrderingMove::Swap : OrderingMove::Insert, position(rng), position(rng) };
+                while (move.to == move.from) move.to = position(rng);
+                return move;
+            };
+            uint64_t count = 0;
+
+            double hot = config.startTemperature;
+            if (hot <= 0.0) {
+                double sum = 0.0;
+                for (int i = 0; i < 100; ++i, ++count) sum += std::fabs(chain.evaluate(randomMove()) - chain.margin());
+                hot = std::max(sum / 100, 1e-9);
+            }
+            double cold = config.endTemperature > 0.0 ? config.endTemperature : hot / 1000;
+            double cooling = std::pow(cold / hot, 1.0 / std::max<uint64_t>(1, config.iterations));
+
+            double best = chain.margin();
+            std::vector<uint32_t> bestOrder;
+            double temperature = hot;
+            for (uint64_t i = 0; i < config.iterations; ++i, ++count, temperature *= cooling) {
+                double delta = chain.evaluate(randomMove()) - chain.margin();
+                if (delta < 0 && uniform(rng) >= std::exp(delta / temperature)) continue;
+                chain.accept();
+                if (chain.margin() > best) {
+                    best = chain.margin();
+                    bestOrder = chain.tokens();
+                }
+            }
+            evaluations += count;
+            if (bestOrder.empty()) continue;
+            GameResult exact = playState(bestOrder.data(), bestOrder.size());
+            std::lock_guard<std::mutex> lock(bestMutex);
+            if (exact.scoreA - exact.scoreB > result.bestMargin) {
+                result.bestMargin = exact.scoreA - exact.scoreB;
+                result.bestOrder = std::move(bestOrder);
+            }
+        }
+    });
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    result.evaluations = evaluations;
+    result.evaluationsPerSecond = result.evaluations / std::max(elapsed.count(), 1e-9);
+    return result;
+}
+
+/**
+ * Inclusive range of column values. The default range admits every value.
+ */
+template <typename T>
+struct ValueRange {
+    T low = std::numeric_limits<T>::lowest();
+    T high = std::numeric_limits<T>::max();
+
+    bool contains(T value) const { return low <= value && value <= high; }
+    bool overlaps(const ValueRange& other) const { return low <= other.high && other.low <= high; }
+    bool covers(const ValueRange& other) const { return low <= other.low && other.high <= high; }
+};
+
+/**
+ * One row of a result archive.
+ */
+struct ArchiveRow {
+    uint64_t id;
+    uint64_t length;
+    double scoreA;
+    double scoreB;
+    double margin;  // scoreA - scoreB
+    uint32_t roster;
+};
+
+/**
+ * A value range per archive column: the predicate of a query (rows with every column in
+ * range match), or the zone map of a block (the smallest ranges holding all its rows).
+ */
+struct ArchiveRanges {
+    ValueRange<uint64_t> id;
+    ValueRange<uint64_t> length;
+    ValueRange<double> scoreA;
+    ValueRange<double> scoreB;
+    ValueRange<double> margin;
+    ValueRange<uint32_t> roster;
+
+    bool matches(const ArchiveRow& row) const {
+        return id.contains(row.id) && length.contains(row.length) && scoreA.contains(row.scoreA) &&
+            scoreB.contains(row.scoreB) && margin.contains(row.margin) && roster.contains(row.roster);
+    }
+
+    bool overlaps(const ArchiveRanges& zones) const {
+        return id.overlaps(zones.id) && length.overlaps(zones.length) && scoreA.overlaps(zones.scoreA) &&
+            scoreB.overlaps(zones.scoreB) && margin.overlaps(zones.margin) && roster.overlaps(zones.roster);
+    }
+
+    bool covers(const ArchiveRanges& zones) const {
+        return id.covers(zones.id) && length.covers(zones.length) && scoreA.covers(zones.scoreA) &&
+            scoreB.covers(zones.scoreB) && margin.covers(zones.margin) && roster.covers(zones.roster);
+    }
+};
+
+/**
+ * Result archive layout (host byte order): a 64-byte file header, then blocks of up to
+ * kArchiveBlockRows rows. Each block is a 128-byte header with its zone map followed by
+ * the columns id, length, scoreA, scoreB, margin and roster, each padded to 64 bytes.
+ */
+const uint32_t kArchiveMagic = 0x41525341;  // "ASRA"
+const uint32_t kArchiveBlockMagic = 0x4b4c4241;  // "ABLK"
+const uint32_t kArchiveVersion = 1;
+const size_t kArchiveFileHeaderBytes = 64;
+const size_t kArchiveBlockHeaderBytes = 128;
+const size_t kArchiveBlockRows = 1 << 16;
+
+struct ArchiveBlockHeader {
+    uint32_t magic;
+    uint32_t rows;
+    uint64_t bytes;  // of the whole block, header included
+    ArchiveRanges zones;
+};
+
+static_assert(sizeof(ArchiveBlockHeader) <= kArchiveBlockHeaderBytes, "archive block header too large");
+
+size_t archiveColumnBytes(size_t rows, size_t width) {
+    return (rows * width + 63) & ~size_t(63);
+}
+
+size_t archiveBlockBytes(size_t rows) {
+    return kArchiveBlockHeaderBytes + 4 * archiveColumnBytes(rows, 8) + archiveColumnBytes(rows, 8) +
+        archiveColumnBytes(rows, 4);
+}
+
+/**
+ * Appends game results to a new result archive, one block per kArchiveBlockRows rows.
+ * The destructor closes the archive too, but only close() reports write errors.
+ */
+class ResultArchiveWriter {
+public:
+    explicit ResultArchiveWriter(const std::string& path)
+        : path_(path), out_(path, std::ios::binary | std::ios::trunc) {
+        char header[kArchiveFileHeaderBytes] = {};
+        std::memcpy(header, &kArchiveMagic, 4);
+        std::memcpy(header + 4, &kArchiveVersion, 4);
+        out_.write(header, sizeof(header));
+        if (!out_) throw std::runtime_error("cannot create result archive " + path);
+    }
+
+    ResultArchiveWriter(const ResultArchiveWriter&) = delete;
+    ResultArchiveWriter& operator=(const ResultArchiveWriter&) = delete;
+
+    ~ResultArchiveWriter() {
+        try {
+            close();
+        }
+        catch (const std::exception&) {
+        }
+    }
+
+    void append(const GameRecord& record, uint32_t roster) {
+        column_.id.push_back(record.id);
+        column_.length.push_back(record.length);
+        column_.scoreA.push_back(record.scoreA);
+        column_.scoreB.push_back(record.scoreB);
+        column_.margin.push_back(record.scoreA - record.scoreB);
+        column_.roster.push_back(roster);
+        ++rows_;
+        if (column_.id.size() == kArchiveBlockRows) flushBlock();
+    }
+
+    void append(const PartialResult& partial, uint32_t roster) {
+        for (const auto& record : partial.records) append(record, roster);
+    }
+
+    uint64_t rows() const { return rows_; }
+
+    void close() {
+        if (!out_.is_open()) return;
+        flushBlock();
+        out_.close();
+        if (!out_) throw std::runtime_error("cannot write result archive " + path_);
+    }
+
+private:
+    template <typename T>
+    static ValueRange<T> zone(const std::vector<T>& values) {
+        auto bounds = std::minmax_element(values.begin(), values.end());
+        ValueRange<T> range;
+        range.low = *bounds.first;
+        range.high = *bounds.second;
+        return range;
+    }
+
+    template <typename T>
+    void writeColumn(const std::vector<T>& values) {
+        static const char kPadding[64] = {};
+        size_t bytes = values.size() * sizeof(T);
+        out_.write(reinterpret_cast<const char*>(values.data()), bytes);
+        out_.write(kPadding, archiveColumnBytes(values.size(), sizeof(T)) - bytes);
+    }
+
+    void flushBlock() {
+        size_t rows = column_.id.size();
+        if (rows == 0) return;
+        char header[kArchiveBlockHeaderBytes] = {};
+        ArchiveBlockHeader block;
+        block.magic = kArchiveBlockMagic;
+        block.rows = static_cast<uint32_t>(rows);
+        block.bytes = archiveBlockBytes(rows);
+        block.zones.id = zone(column_.id);
+        block.zones.length = zone(column_.length);
+        block.zones.scoreA = zone(column_.scoreA);
+        block.zones.scoreB = zone(column_.scoreB);
+        block.zones.margin = zone(column_.margin);
+        block.zones.roster = zone(column_.roster);
+        std::memcpy(header, &block, sizeof(block));
+        out_.write(header, sizeof(header));
+        writeColumn(column_.id);
+        writeColumn(column_.length);
+        writeColumn(column_.scoreA);
+        writeColumn(column_.scoreB);
+        writeColumn(column_.margin);
+        writeColumn(column_.roster);
+        column_ = Columns();
+        if (!out_) throw std::runtime_error("cannot write result archive " + path_);
+    }
+
+    struct Columns {
+        std::vector<uint64_t> id;
+        std::vector<uint64_t> length;
+        std::vector<double> scoreA;
+        std::vector<double> scoreB;
+        std::vector<double> margin;
+        std::vector<uint32_t> roster;
+    };
+
+    std::string path_;
+    std::ofstream out_;
+    Columns column_;
+    uint64_t rows_ = 0;
+};
+
+/**
+ * Blocks read, skipped by their zone map, or matched whole by it, and rows that matched.
+ */
+struct ArchiveScanStats {
+    uint64_t blocksScanned = 0;
+    uint64_t blocksSkipped = 0;
+    uint64_t blocksCovered = 0;
+    uint64_t rowsMatched = 0;
+
+    void merge(const ArchiveScanStats& other) {
+        blocksScanned += other.blocksScanned;
+        blocksSkipped += other.blocksSkipped;
+        blocksCovered += other.blocksCovered;
+        rowsMatched += other.rowsMatched;
+    }
+};
+
+/**
+ * Read-only memory-mapped result archive. Queries skip the blocks whose zone maps lie
+ * outside the query, take blocks inside it whole, and filter the others column by
+ * column with the vectorized range kernels, only for columns the zone map does not
+ * already satisfy.
+ */
+class ResultArchive {
+public:
+    explicit ResultArchive(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::system_error(errno, std::generic_category(), "cannot open result archive " + path);
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw std::system_error(errno, std::generic_category(), "cannot stat result archive " + path);
+        }
+        bytes_ = static_cast<size_t>(info.st_size);
+        uint32_t magic = 0, version = 0;
+        if (bytes_ >= kArchiveFileHeaderBytes) {
+            mapping_ = mmap(nullptr, bytes_, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (mapping_ == MAP_FAILED) {
+            mapping_ = nullptr;
+            throw std::system_error(errno, std::generic_category(), "cannot map result archive " + path);
+        }
+        const char* base = static_cast<const char*>(mapping_);
+        if (base != nullptr) {
+            std::memcpy(&magic, base, 4);
+            std::memcpy(&version, base + 4, 4);
+        }
+        if (magic != kArchiveMagic || version != kArchiveVersion) {
+            unmap();
+            throw std::runtime_error("not a result archive: " + path);
+        }
+        for (size_t offset = kArchiveFileHeaderBytes; offset < bytes_;) {
+            const ArchiveBlockHeader* header = reinterpret_cast<const ArchiveBlockHeader*>(base + offset);
+            if (bytes_ - offset < kArchiveBlockHeaderBytes || header->magic != kArchiveBlockMagic ||
+                header->bytes != archiveBlockBytes(header->rows) || bytes_ - offset < header->bytes) {
+                unmap();
+                throw std::runtime_error("truncated result archive " + path);
+            }
+            Block block;
+            block.header = header;
+            const char* column = base + offset + kArchiveBlockHeaderBytes;
+            size_t wide = archiveColumnBytes(header->rows, 8);
+            block.id = reinterpret_cast<const uint64_t*>(column);
+            block.length = reinterpret_cast<const uint64_t*>(column + wide);
+            block.scoreA = reinterpret_cast<const double*>(column + 2 * wide);
+            block.scoreB = reinterpret_cast<const double*>(column + 3 * wide);
+            block.margin = reinterpret_cast<const double*>(column + 4 * wide);
+            block.roster = reinterpret_cast<const uint32_t*>(column + 5 * wide);
+            blocks_.push_back(block);
+            rows_ += header->rows;
+            offset += header->bytes;
+        }
+    }
+
+    ResultArchive(const ResultArchive&) = delete;
+    ResultArchive& operator=(const ResultArchive&) = delete;
+
+    ~ResultArchive() { unmap(); }
+
+    uint64_t rows() const { return rows_; }
+
+    size_t blocks() const { return blocks_.size(); }
+
+    const ArchiveRanges& zoneMap(size_t block) const { return blocks_.at(block).header->zones; }
+
+    /**
+     * Counts the rows matching the query, scanning blocks on the given number of threads.
+     */
+    ArchiveScanStats count(const ArchiveRanges& query, unsigned threads = defaultThreadCount()) const {
+        std::vector<ArchiveScanStats> perWorker(std::max(1u, threads));
+        parallelChunks(blocks_.size(), threads, [&](size_t first, size_t last, unsigned worker) {
+            ArchiveScanStats& stats = perWorker[worker];
+            for (size_t b = first; b < last; ++b) {
+                filterBlock(blocks_[b], query, stats, [&stats](const Block&, size_t, size_t rows, const uint8_t* mask) {
+                    uint64_t matched = 0;
+                    for (size_t i = 0; i < rows; ++i) matched += mask[i];
+                    stats.rowsMatched += matched;
+                });
+            }
+        });
+        ArchiveScanStats total;
+        for (const auto& stats : perWorker) total.merge(stats);
+        return total;
+    }
+
+    /**
+     * Calls fn(const ArchiveRow&) for every row matching the query, in archive order.
+     */
+    template <typename Fn>
+    ArchiveScanStats scan(const ArchiveRanges& query, Fn fn) const {
+        ArchiveScanStats stats;
+        for (const Block& block : blocks_) {
+            filterBlock(block, query, stats, [&](const Block& b, size_t first, size_t rows, const uint8_t* mask) {
+                for (size_t i = 0; i < rows; ++i) {
+                    if (mask[i] == 0) continue;
+                    size_t r = first + i;
+                    ++stats.rowsMatched;
+                    fn(ArchiveRow{ b.id[r], b.length[r], b.scoreA[r], b.scoreB[r], b.margin[r], b.roster[r] });
+                }
+            });
+        }
+        return stats;
+    }
+
+private:
+    static const size_t kChunkRows = 4096;
+
+    struct Block {
+        const ArchiveBlockHeader* header;
+        const uint64_t* id;
+        const uint64_t* length;
+        const double* scoreA;
+        const double* scoreB;
+        const double* margin;
+        const uint32_t* roster;
+    };
+
+    /**
+     * Calls emit(block, first, rows, mask) for each chunk of rows of a block that the
+     * zone map does not rule out; mask[i] is 1 where row first + i matches.
+     */
+    template <typename Emit>
+    static void filterBlock(const Block& block, const ArchiveRanges& query, ArchiveScanStats& stats, Emit emit) {
+        const ArchiveRanges& zones = block.header->zones;
+        if (!query.overlaps(zones)) {
+            ++stats.blocksSkipped;
+            return;
+        }
+        bool covered = query.covers(zones);
+        ++(covered ? stats.blocksCovered : stats.blocksScanned);
+        const SimdKernels& kernels = simdKernels();
+        uint8_t mask[kChunkRows];
+        for (size_t first = 0; first < block.header->rows; first += kChunkRows) {
+            size_t rows = std::min<size_t>(kChunkRows, block.header->rows - first);
+            std::memset(mask, 1, rows);
+            if (!covered) {
+                if (!query.id.covers(zones.id)) {
+                    kernels.filterUint64s(block.id + first, rows, query.id.low, query.id.high, mask);
+                }
+                if (!query.length.covers(zones.length)) {
+                    kernels.filterUint64s(block.length + first, rows, query.length.low, query.length.high, mask);
+                }
+                if (!query.scoreA.covers(zones.scoreA)) {
+                    kernels.filterDoubles(block.scoreA + first, rows, query.scoreA.low, query.scoreA.high, mask);
+                }
+                if (!query.scoreB.covers(zones.scoreB)) {
+                    kernels.filterDoubles(block.scoreB + first, rows, query.scoreB.low, query.scoreB.high, mask);
+                }
+                if (!query.margin.covers(zones.margin)) {
+                    kernels.filterDoubles(block.margin + first, rows, query.margin.low, query.margin.high, mask);
+                }
+                if (!query.roster.covers(zones.roster)) {
+                    kernels.filterUint32s(block.roster + first, rows, query.roster.low, query.roster.high, mask);
+                }
+            }
+            emit(block, first, rows, mask);
+        }
+    }
+
+    void unmap() {
+        if (mapping_ != nullptr) munmap(mapping_, bytes_);
+        mapping_ = nullptr;
+    }
+
+    void* mapping_ = nullptr;
+    size_t bytes_ = 0;
+    std::vector<Block> blocks_;
+    uint64_t rows_ = 0;
+};
+
+const size_t ResultArchive::kChunkRows;
+
+// C API, see game_c_api.h
+
+uint32_t game_api_version(void) {
+    return GAME_API_VERSION;
+}
+
+int game_play(const uint32_t* tokens, size_t count, double* score_a, double* score_b) {
+    if ((tokens == nullptr && count > 0) || score_a == nullptr || score_b == nullptr) {
+        return GAME_INVALID_ARGUMENT;
+    }
+    try {
+        GameResult result = playState(tokens, count);
+        *score_a = result.scoreA;
+        *score_b = result.scoreB;
+    }
+    catch (...) {
+        return GAME_INTERNAL_ERROR;
+    }
+    return GAME_OK;
+}
+
+int game_play_batch(const uint32_t* tokens, const size_t* offsets, size_t games,
+    double* scores, unsigned threads) {
+    return game_play_batch_fingerprints(tokens, offsets, games, scores, nullptr, threads);
+}
+
+int game_play_batch_fingerprints(const uint32_t* tokens, const size_t* offsets, size_t games,
+    double* scores, uint64_t* fingerprints, unsigned threads) {
+    if (games == 0) return GAME_OK;
+    if (offsets == nullptr || scores == nullptr || (tokens == nullptr && offsets[games] > offsets[0])) {
+        return GAME_INVALID_ARGUMENT;
+    }
+    for (size_t g = 0; g < games; ++g) {
+        if (offsets[g] > offsets[g + 1]) return GAME_INVALID_ARGUMENT;
+    }
+    try {
+        parallelChunks(games, threads == 0 ? defaultThreadCount() : threads,
+            [&](size_t begin, size_t end, unsigned) {
+                for (size_t g = begin; g < end; ++g) {
+                    GameResult result = playState(tokens + offsets[g], offsets[g + 1] - offsets[g]);
+                    scores[2 * g] = result.scoreA;
+                    scores[2 * g + 1] = result.scoreB;
+                    if (fingerprints != nullptr) fingerprints[g] = result.fingerprint;
+                }
+            });
+    }
+    catch (const std::bad_alloc&) {
+        return GAME_OUT_OF_MEMORY;
+    }
+    catch (...) {
+        return GAME_INTERNAL_ERROR;  // e.g. threads could not be started
+    }
+    return GAME_OK;
+}
+
+GameState* game_state_new(void) {
+    return new (std::nothrow) GameState();
+}
+
+void game_state_free(GameState* state) {
+    delete state;
+}
+
+int game_state_step(GameState* state, const uint32_t* tokens, size_t count) {
+    if (state == nullptr || (tokens == nullptr && count > 0)) return GAME_INVALID_ARGUMENT;
+    try {
+        for (size_t i = 0; i < count; ++i) {
+            state->step(tokens[i]);
+        }
+    }
+    catch (...) {
+        return GAME_INTERNAL_ERROR;
+    }
+    return GAME_OK;
+}
+
+int game_state_fingerprint(const GameState* state, uint64_t* fingerprint) {
+    if (state == nullptr || fingerprint == nullptr) return GAME_INVALID_ARGUMENT;
+    *fingerprint = state->fingerprint;  // cannot throw
+    return GAME_OK;
+}
+
+int game_state_snapshot(const GameState* state, GameSnapshot* snapshot) {
+    if (state == nullptr || snapshot == nullptr) return GAME_INVALID_ARGUMENT;
+    for (int box = 0; box < 4; ++box) {
+        snapshot->weights[box] = state->weight(box);
+    }
+    for (int g = 0; g < 2; ++g) {
+        std::copy(state->window[g], state->window[g] + 3, snapshot->green_window[g]);
+        snapshot->green_window_size[g] = state->windowSize[g];
+        snapshot->blue_seen[g] = state->blueSeen[g];
+        snapshot->blue_min[g] = state->blueMin[g];
+        snapshot->blue_max[g] = state->blueMax[g];
+    }
+    snapshot->score_a = state->scores[0];
+    snapshot->score_b = state->scores[1];
+    snapshot->turn = state->turn;
+    return GAME_OK;
+}
+
+#ifdef ASAPHUS_BATCH_TOOL
+/**
+ * Command line front end of the partition mode, built with
+ * g++ --std=c++14 -O2 -DASAPHUS_NO_TESTS -DASAPHUS_BATCH_TOOL asaphus_coding_challenge.cpp -o batch_tool
+ *
+ *   batch_tool shard <manifest> <shard> <shards> <partial>
+ *   batch_tool merge <output> <partial>...
+ */
+int main(int argc, char** argv) {
+    try {
+        std::string command = argc > 1 ? argv[1] : "";
+        if (command == "shard" && argc == 6) {
+            writePartial(argv[5], runShard(argv[2], static_cast<uint32_t>(std::stoul(argv[3])),
+                static_cast<uint32_t>(std::stoul(argv[4])), *findEngine("state")));
+            return 0;
+        }
+        if (command == "merge" && argc >= 4) {
+            std::vector<PartialResult> partials;
+            for (int i = 3; i < argc; ++i) partials.push_back(readPartial(argv[i]));
+            PartialResult merged = mergePartials(partials);
+            writePartial(argv[2], merged);
+            std::cout << merged.records.size() << " games, " << merged.stats.winsA << " won by A, "
+                << merged.stats.winsB << " won by B, " << merged.stats.ties << " ties, fingerprint "
+                << std::hex << batchFingerprint(merged.records) << std::dec << std::endl;
+            return 0;
+        }
+        std::cerr << "usage: " << argv[0] << " shard <manifest> <shard> <shards> <partial>\n"
+            << "       " << argv[0] << " merge <output> <partial>..." << std::endl;
+        return 2;
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+#endif  // ASAPHUS_BATCH_TOOL
+
+#ifndef ASAPHUS_NO_TESTS
+
+// Test cases
+
+// Autotuning in the tests must not leave a cache file in the user's home
+const int g_noAutotuneCache = ::setenv("ASAPHUS_AUTOTUNE_CACHE", "", 0);
+
+TEST_CASE("Final scores for first 4 Fibonacci numbers", "[fibonacci4]") {
+    std::vector<uint32_t> inputs{ 1, 1, 2, 3 };
+    auto result = play(inputs);
+    REQUIRE(result.first == 13.0);
+    REQUIRE(result.second == 25.0);
+}
+
+TEST_CASE("Final scores for first 8 Fibonacci numbers", "[fibonacci8]") {
+    std::vector<uint32_t> inputs{ 1, 1, 2, 3, 5, 8, 13, 21 };
+    auto result = play(inputs);
+    REQUIRE(result.first == 155.0);
+    REQUIRE(result.second == 366.25);
 }
 
 TEST_CASE("Test absorption of green box", "[green]") {
@@ -260,16 +5319,1495 @@ TEST_CASE("Test absorption of green box", "[green]") {
     REQUIRE(greenBox->getWeight() == 11.0);
 }
 
-TEST_CASE("Test absorption of blue box", "[blue]") {
-    std::unique_ptr<Box> blueBox = Box::makeBlueBox(1.0);
-    REQUIRE(blueBox->absorb(3.0) == 24.0);
-    REQUIRE(blueBox->absorb(2.0) == 18.0);
-    REQUIRE(blueBox->absorb(4.0) == 25.0);
-    REQUIRE(blueBox->absorb(1.0) == 19.0);
-    REQUIRE(blueBox->getWeight() == 11.0);
+TEST_CASE("Test absorption of blue box", "[blue]") {
+    std::unique_ptr<Box> blueBox = Box::makeBlueBox(1.0);
+    REQUIRE(blueBox->absorb(3.0) == 24.0);
+    REQUIRE(blueBox->absorb(2.0) == 18.0);
+    REQUIRE(blueBox->absorb(4.0) == 25.0);
+    REQUIRE(blueBox->absorb(1.0) == 19.0);
+    REQUIRE(blueBox->getWeight() == 11.0);
+
+}
+
+// Helpers shared by the test cases below
+
+/**
+ * Plays the game like play(), without console output.
+ */
+GameResult referenceScores(const std::vector<uint32_t>& input_weights) {
+    return playReference(input_weights.data(), input_weights.size());
+}
+
+/**
+ * Deterministic pseudo-random token weights in [0, max_weight].
+ */
+std::vector<uint32_t> randomTokens(size_t count, uint32_t max_weight, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<uint32_t> dist(0, max_weight);
+    std::vector<uint32_t> tokens(count);
+    for (auto& t : tokens) t = dist(rng);
+    return tokens;
+}
+
+TEST_CASE("GameState follows the Box mechanics", "[state]") {
+    for (uint32_t seed = 1; seed <= 5; ++seed) {
+        auto inputs = randomTokens(1000, seed * 50, seed);
+        GameState state;
+        for (auto w : inputs) state.step(w);
+        auto expected = referenceScores(inputs);
+        REQUIRE(state.scores[0] == expected.scoreA);
+        REQUIRE(state.scores[1] == expected.scoreB);
+    }
+    GameState fib;
+    for (uint32_t w : { 1, 1, 2, 3, 5, 8, 13, 21 }) fib.step(w);
+    REQUIRE(fib.scores[0] == 155.0);
+    REQUIRE(fib.scores[1] == 366.25);
+}
+
+TEST_CASE("Exact expectation matches enumeration of all token sequences", "[exact]") {
+    std::vector<TokenProbability> distribution{ { 1, 0.5 }, { 2, 0.3 }, { 5, 0.2 } };
+    const unsigned turns = 6;
+    double expectedA = 0, expectedB = 0, winA = 0, winB = 0, tie = 0;
+    for (size_t sequence = 0; sequence < 729; ++sequence) {
+        GameState state;
+        double p = 1.0;
+        for (unsigned t = 0, rest = static_cast<unsigned>(sequence); t < turns; ++t, rest /= 3) {
+            state.step(distribution[rest % 3].token);
+            p *= distribution[rest % 3].probability;
+        }
+        expectedA += p * state.scores[0];
+        expectedB += p * state.scores[1];
+        double diff = state.scores[0] - state.scores[1];
+        (diff > 0 ? winA : diff < 0 ? winB : tie) += p;
+    }
+
+    for (unsigned threads : { 1u, 3u }) {
+        auto exact = computeExactExpectation(distribution, turns, true, threads);
+        REQUIRE(exact.expectedScoreA == Approx(expectedA));
+        REQUIRE(exact.expectedScoreB == Approx(expectedB));
+        REQUIRE(exact.winProbabilityA == Approx(winA));
+        REQUIRE(exact.winProbabilityB == Approx(winB));
+        REQUIRE(exact.tieProbability == Approx(tie).margin(1e-12));
+        REQUIRE(exact.peakStates < 729);
+    }
+
+    auto scoresOnly = computeExactExpectation(distribution, turns, false, 2);
+    REQUIRE(scoresOnly.expectedScoreA == Approx(expectedA));
+    REQUIRE(std::isnan(scoresOnly.winProbabilityA));
+
+    auto certain = computeExactExpectation({ { 1, 1.0 } }, 4);
+    auto reference = referenceScores({ 1, 1, 1, 1 });
+    REQUIRE(certain.expectedScoreA == reference.scoreA);
+    REQUIRE(certain.expectedScoreB == reference.scoreB);
+    REQUIRE(certain.tieProbability == 1.0);
+}
+
+
+TEST_CASE("Box score previews do not change the box", "[strategy]") {
+    std::unique_ptr<Box> greenBox = Box::makeGreenBox(0.0);
+    std::unique_ptr<Box> blueBox = Box::makeBlueBox(0.0);
+    for (double w : { 4.0, 1.0, 7.0, 2.0, 9.0 }) {
+        double greenPreview = greenBox->previewScore(w);
+        double bluePreview = blueBox->previewScore(w);
+        REQUIRE(greenBox->previewScore(w) == greenPreview);
+        REQUIRE(greenBox->absorb(w) == greenPreview);
+        REQUIRE(blueBox->absorb(w) == bluePreview);
+    }
+}
+
+TEST_CASE("Tie-break strategies choose among equally light boxes", "[strategy]") {
+    auto makeTiedBoxes = []() {
+        std::vector<std::unique_ptr<Box> > boxes;
+        boxes.emplace_back(Box::makeGreenBox(0.0));
+        boxes.emplace_back(Box::makeBlueBox(0.0));
+        return boxes;
+    };
+    std::vector<uint32_t> inputs{ 3, 1, 2, 2 };
+
+    FirstBoxStrategy first;
+    auto boxes = makeTiedBoxes();
+    auto plain = playWithStrategies(inputs, boxes, nullptr, nullptr);
+    auto firstBoxes = makeTiedBoxes();
+    REQUIRE(playWithStrategies(inputs, firstBoxes, &first, &first) == plain);
+
+    // Green scores 3^2 = 9 for the first token, blue scores pairing(3, 3) = 24
+    GreedyScoreStrategy greedy;
+    auto greedyBoxes = makeTiedBoxes();
+    auto greedyResult = playWithStrategies({ 3 }, greedyBoxes, &greedy, nullptr);
+    REQUIRE(greedyResult.first == 24.0);
+    REQUIRE(greedyBoxes[1]->getWeight() == 3.0);
+
+    // Without further turns to look at, lookahead rates candidates like the greedy strategy
+    LookaheadStrategy noLookahead(0);
+    auto greedyPair = makeTiedBoxes();
+    auto noLookaheadPair = makeTiedBoxes();
+    REQUIRE(playWithStrategies(inputs, noLookaheadPair, &noLookahead, &noLookahead)
+        == playWithStrategies(inputs, greedyPair, &greedy, &greedy));
+
+    // Tied green and blue boxes next to a heavier blue box, tokens 3, 1, 9, two turns ahead:
+    //   green takes 3: 3^2 = 9, blue takes 1 for the opponent: -pairing(1, 1) = -4,
+    //     blue (weight 1) takes 9: +pairing(9, 9) = 180, so 185
+    //   blue takes 3: pairing(3, 3) = 24, green takes 1: -1, green takes 9: +81, so 104
+    // Lookahead therefore picks green where greedy picks blue.
+    LookaheadStrategy lookahead(2);
+    auto makeRoster = [&makeTiedBoxes]() {
+        auto boxes = makeTiedBoxes();
+        boxes.emplace_back(Box::makeBlueBox(5.0));
+        return boxes;
+    };
+    const uint32_t upcoming[] = { 3, 1, 9 };
+    auto roster = makeRoster();
+    std::vector<Box*> tied{ roster[0].get(), roster[1].get() };
+    REQUIRE(lookahead.choose(tied, roster, upcoming, 3) == 0);
+    REQUIRE(greedy.choose(tied, roster, upcoming, 3) == 1);
+    REQUIRE(lookahead.choose(tied, roster, upcoming, 2) == 1);  // green 9 - 4, blue 24 - 1
+    // Then B's plain turn puts 1 into the blue box (4), and A's 9 scores pairing(1, 9) = 64
+    auto lookaheadRoster = makeRoster();
+    REQUIRE(playWithStrategies({ 3, 1, 9 }, lookaheadRoster, &lookahead, nullptr) == std::make_pair(73.0, 4.0));
+
+    // Without ties the strategy is never consulted
+    auto standard = makeStandardBoxes();
+    REQUIRE(playWithStrategies({ 1, 1, 2, 3 }, standard, &greedy, &lookahead)
+        == std::make_pair(13.0, 25.0));
+}
+
+TEST_CASE("Engines and batches agree with the reference", "[engines]") {
+    std::vector<std::vector<uint32_t> > games;
+    for (uint32_t seed = 0; seed < 40; ++seed) {
+        games.push_back(randomTokens(seed * 7, 100 + seed, seed));
+    }
+    for (const auto& engine : gameEngines()) {
+        for (const auto& game : games) {
+            REQUIRE(engine.play(game.data(), game.size()) == referenceScores(game));
+        }
+        auto batch = playBatch(games, engine, 3);
+        for (size_t g = 0; g < games.size(); ++g) {
+            REQUIRE(batch[g] == referenceScores(games[g]));
+        }
+    }
+}
+
+TEST_CASE("Autotuner calibrates once per machine and caches its decisions", "[autotune]") {
+    std::string path = "/tmp/asaphus_autotune_test_" + std::to_string(::getpid()) + ".txt";
+    std::remove(path.c_str());
+
+    Autotuner first(path);
+    REQUIRE(first.calibrated());
+    auto inputs = randomTokens(500, 30, 7);
+    REQUIRE(first.play(inputs) == referenceScores(inputs));
+    REQUIRE(first.batchThreadsFor(10) >= 1);
+
+    Autotuner second(path);
+    REQUIRE_FALSE(second.calibrated());
+    REQUIRE(std::string(second.engineFor(10).name) == first.engineFor(10).name);
+    std::vector<std::vector<uint32_t> > games(20, inputs);
+    for (const auto& result : second.playBatch(games)) {
+        REQUIRE(result == referenceScores(inputs));
+    }
+
+    {
+        std::ofstream stale(path, std::ios::trunc);
+        stale << "asaphus-autotune 2\nmachine some other cpu\nengines " << Autotuner::enginesKey()
+            << "\nsingle 10 state 1\nbatch 10 state 1\n";
+    }
+    Autotuner third(path);
+    REQUIRE(third.calibrated());
+
+    // A table chosen among other engines is stale too
+    {
+        std::ofstream stale(path, std::ios::trunc);
+        stale << "asaphus-autotune 2\nmachine " << Autotuner::machineKey()
+            << "\nengines reference state\nsingle 10 state 1\nbatch 10 state 1\n";
+    }
+    Autotuner fourth(path);
+    REQUIRE(fourth.calibrated());
+
+    // A table cut short, e.g. read while another process wrote it, is rejected
+    std::string table;
+    {
+        std::ifstream in(path);
+        std::getline(in, table, '\0');
+    }
+    {
+        std::ofstream cut(path, std::ios::trunc);
+        cut << table.substr(0, table.rfind("batch"));
+    }
+    Autotuner fifth(path);
+    REQUIRE(fifth.calibrated());
+    REQUIRE_FALSE(Autotuner(path).calibrated());
+
+    Autotuner uncached("");
+    REQUIRE(uncached.calibrated());
+    REQUIRE(uncached.play(inputs) == referenceScores(inputs));
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Every instruction set variant matches the reference", "[simd]") {
+    const SimdKernels& detected = simdKernels();
+    std::vector<std::vector<uint32_t> > games;
+    for (uint32_t seed = 0; seed < 19; ++seed) {
+        games.push_back(randomTokens(seed * 13, 1000, seed));
+    }
+
+    for (Isa isa : { Isa::Baseline, Isa::Sse42, Isa::Avx2, Isa::Avx512 }) {
+        if (!forceIsa(isa)) continue;
+        INFO(isaName(isa));
+        REQUIRE(simdKernels().isa == isa);
+
+        std::vector<GameResult> lanes(games.size());
+        playLaneGames(games.data(), games.size(), lanes.data());
+        for (size_t g = 0; g < games.size(); ++g) {
+            REQUIRE(lanes[g] == referenceScores(games[g]));
+            REQUIRE(playTwoPhase(games[g].data(), games[g].size()) == referenceScores(games[g]));
+        }
+    }
+    forceIsa(detected.isa);
+}
+
+TEST_CASE("Narrow tokens pick the smallest width per block", "[narrow]") {
+    const size_t block = NarrowTokens::kBlockSize;
+    std::vector<uint32_t> tokens = randomTokens(block, 200, 1);
+    auto wide = randomTokens(block, 60000, 2);
+    tokens.insert(tokens.end(), wide.begin(), wide.end());
+    auto huge = randomTokens(block / 2 + 5, 4000000000u, 3);
+    tokens.insert(tokens.end(), huge.begin(), huge.end());
+
+    NarrowTokens narrow(tokens);
+    REQUIRE(narrow.size() == tokens.size());
+    REQUIRE(narrow.blockCount() == 3);
+    REQUIRE(narrow.blockWidth(0) == 1);
+    REQUIRE(narrow.blockWidth(1) == 2);
+    REQUIRE(narrow.blockWidth(2) == 4);
+    REQUIRE(narrow.bytes() == block * 3 + huge.size() * 4);
+
+    const SimdKernels& detected = simdKernels();
+    for (Isa isa : { Isa::Baseline, Isa::Sse42, Isa::Avx2, Isa::Avx512 }) {
+        if (!forceIsa(isa)) continue;
+        INFO(isaName(isa));
+        std::vector<uint32_t> decoded;
+        std::vector<uint32_t> buffer(block);
+        for (size_t b = 0; b < narrow.blockCount(); ++b) {
+            decoded.insert(decoded.end(), buffer.begin(), buffer.begin() + narrow.decode(b, buffer.data()));
+        }
+        REQUIRE(decoded == tokens);
+        REQUIRE(playNarrow(narrow) == referenceScores(tokens));
+    }
+    forceIsa(detected.isa);
+
+    NarrowTokens appended;
+    appended.append(tokens.data(), 100);
+    appended.append(tokens.data() + 100, tokens.size() - 100);
+    REQUIRE(appended.bytes() == narrow.bytes());
+    REQUIRE(appended[block + 7] == tokens[block + 7]);
+    NarrowTokens oneByOne;
+    for (uint32_t token : tokens) oneByOne.append(&token, 1);
+    REQUIRE(oneByOne.size() == tokens.size());
+    REQUIRE(oneByOne.blockCount() == 3);
+    REQUIRE(oneByOne.blockWidth(2) == 4);
+    REQUIRE(oneByOne.bytes() == narrow.bytes());
+    REQUIRE(oneByOne[2 * block + 3] == tokens[2 * block + 3]);
+    REQUIRE(playNarrow(oneByOne) == referenceScores(tokens));
+
+    std::vector<NarrowTokens> games{ narrow, NarrowTokens({ 1, 1, 2, 3 }), NarrowTokens() };
+    auto results = playNarrowBatch(games, 2);
+    REQUIRE(results[0] == referenceScores(tokens));
+    REQUIRE(results[1] == referenceScores({ 1, 1, 2, 3 }));
+    REQUIRE(results[2] == GameResult());
+}
+
+TEST_CASE("C API plays single games, flat batches and live games", "[c_api]") {
+    REQUIRE(game_api_version() == GAME_API_VERSION);
+
+    std::vector<uint32_t> fibonacci{ 1, 1, 2, 3, 5, 8, 13, 21 };
+    double a = 0, b = 0;
+    REQUIRE(game_play(fibonacci.data(), fibonacci.size(), &a, &b) == GAME_OK);
+    REQUIRE(a == 155.0);
+    REQUIRE(b == 366.25);
+    REQUIRE(game_play(nullptr, 3, &a, &b) == GAME_INVALID_ARGUMENT);
+
+    std::vector<uint32_t> tokens;
+    std::vector<size_t> offsets{ 0 };
+    std::vector<std::vector<uint32_t> > games;
+    for (uint32_t seed = 0; seed < 50; ++seed) {
+        games.push_back(randomTokens(seed * 3, 99, seed));
+        tokens.insert(tokens.end(), games.back().begin(), games.back().end());
+        offsets.push_back(tokens.size());
+    }
+    std::vector<double> scores(2 * games.size());
+    REQUIRE(game_play_batch(tokens.data(), offsets.data(), games.size(), scores.data(), 0) == GAME_OK);
+    for (size_t g = 0; g < games.size(); ++g) {
+        auto expected = referenceScores(games[g]);
+        REQUIRE(scores[2 * g] == expected.scoreA);
+        REQUIRE(scores[2 * g + 1] == expected.scoreB);
+    }
+    std::swap(offsets[3], offsets[4]);
+    REQUIRE(game_play_batch(tokens.data(), offsets.data(), games.size(), scores.data(), 2)
+        == GAME_INVALID_ARGUMENT);
+
+    GameState* live = game_state_new();
+    REQUIRE(live != nullptr);
+    REQUIRE(game_state_step(live, fibonacci.data(), 4) == GAME_OK);
+    GameSnapshot snapshot;
+    REQUIRE(game_state_snapshot(live, &snapshot) == GAME_OK);
+    REQUIRE(snapshot.turn == 4);
+    REQUIRE(snapshot.score_a == 13.0);
+    REQUIRE(snapshot.score_b == 25.0);
+    REQUIRE(snapshot.weights[3] == 3.3);
+    REQUIRE(snapshot.blue_seen[0] == 1);
+    REQUIRE(snapshot.blue_min[0] == 2);
+    REQUIRE(game_state_step(live, fibonacci.data() + 4, 4) == GAME_OK);
+    REQUIRE(game_state_snapshot(live, &snapshot) == GAME_OK);
+    REQUIRE(snapshot.score_b == 366.25);
+    REQUIRE(snapshot.green_window_size[0] == 2);
+    game_state_free(live);
+
+    // A worker that cannot be started must not leave the started ones unjoined
+    struct FailingCopy {
+        std::atomic<int>* copies;
+        std::atomic<int>* ran;
+        FailingCopy(std::atomic<int>* c, std::atomic<int>* r) : copies(c), ran(r) {}
+        FailingCopy(const FailingCopy& other) : copies(other.copies), ran(other.ran) {
+            if (++*copies == 2) throw std::runtime_error("cannot start worker");
+        }
+        void operator()(size_t, size_t, unsigned) const { ++*ran; }
+    };
+    std::atomic<int> copies{ 0 }, ran{ 0 };
+    REQUIRE_THROWS_AS(parallelChunks(4, 4, FailingCopy(&copies, &ran)), std::runtime_error);
+    REQUIRE(ran == 1);
+}
+
+TEST_CASE("Indexed replay restores the state at any turn", "[replay]") {
+    auto inputs = randomTokens(5000, 500, 11);
+    std::vector<GameState> expected{ GameState() };
+    for (auto w : inputs) {
+        expected.push_back(expected.back());
+        expected.back().step(w);
+    }
+
+    for (size_t interval : { size_t(1), size_t(64), size_t(5000), size_t(7000) }) {
+        IndexedReplay replay(inputs, interval);
+        REQUIRE(replay.checkpointInterval() == interval);
+        for (size_t t : std::vector<size_t>{ 0, 1, 63, 64, 65, 2500, 4999, 5000 }) {
+            GameState state = replay.stateAt(t);
+            REQUIRE(state.turn == t);
+            REQUIRE(sameBoxes(state, expected[t]));
+            REQUIRE(state.scores[0] == expected[t].scores[0]);
+            REQUIRE(state.scores[1] == expected[t].scores[1]);
+        }
+        REQUIRE_THROWS_AS(replay.stateAt(5001), std::out_of_range);
+    }
+
+    size_t interval = IndexedReplay::intervalForBudget(inputs.size(), 20 * sizeof(GameState));
+    IndexedReplay budgeted(inputs, interval);
+    REQUIRE(budgeted.checkpointBytes() <= 21 * sizeof(GameState));
+    REQUIRE(budgeted.finalState().scores[0] == referenceScores(inputs).scoreA);
+}
+
+/**
+ * Deterministic pseudo-random roster with repeated initial weights, so that ties occur.
+ */
+std::vector<BoxSpec> randomRoster(size_t count, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<BoxSpec> roster(count);
+    for (auto& spec : roster) {
+        spec.kind = rng() % 2 ? BoxKind::Green : BoxKind::Blue;
+        spec.initialWeight = (rng() % 50) * 0.5;
+    }
+    return roster;
+}
+
+TEST_CASE("Large roster engine matches the Box mechanics, also interleaved", "[roster]") {
+    auto roster = randomRoster(1000, 4);
+    std::vector<std::vector<uint32_t> > games;
+    for (uint32_t seed = 0; seed < 11; ++seed) {
+        games.push_back(randomTokens(3000 + seed * 100, 40, seed));
+    }
+    std::vector<GameResult> expected;
+    for (const auto& game : games) {
+        auto boxes = makeBoxes(roster);
+        auto scores = playWithStrategies(game, boxes, nullptr, nullptr);
+        expected.push_back(GameResult{ scores.first, scores.second });
+        REQUIRE(playLargeRoster(roster, game) == expected.back());
+    }
+    for (size_t interleave : { 1, 4, 16 }) {
+        REQUIRE(playLargeRosterBatch(roster, games, interleave) == expected);
+    }
+
+    std::vector<BoxSpec> standard{ { BoxKind::Green, 0.0 }, { BoxKind::Green, 0.1 },
+        { BoxKind::Blue, 0.2 }, { BoxKind::Blue, 0.3 } };
+    REQUIRE(playLargeRoster(standard, { 1, 1, 2, 3, 5, 8, 13, 21 }) == (GameResult{ 155.0, 366.25 }));
+}
+
+TEST_CASE("Real-time game steps without allocating and reports jitter", "[realtime]") {
+    cpu_set_t before;
+    REQUIRE(sched_getaffinity(0, sizeof(before), &before) == 0);
+    int cpu = 0;
+    while (!CPU_ISSET(cpu, &before)) ++cpu;
+    {
+        RealtimeConfig config;
+        config.lockMemory = true;
+        config.cpu = cpu;
+        std::unique_ptr<RealtimeGame> game;
+        try {
+            game.reset(new RealtimeGame(config));
+            REQUIRE(game->memoryLocked());
+            REQUIRE(game->pinned());
+        }
+        catch (const std::system_error& e) {
+            // Containers often forbid mlock (RLIMIT_MEMLOCK) or restrict the CPUs
+            WARN("skipping the mlock and pinning checks: " << e.what());
+            game.reset(new RealtimeGame(RealtimeConfig()));
+        }
+
+        auto inputs = randomTokens(10000, 1000, 3);
+        for (auto w : inputs) game->step(w);
+        REQUIRE(game->state().scores[0] == referenceScores(inputs).scoreA);
+        REQUIRE(game->state().scores[1] == referenceScores(inputs).scoreB);
+
+        const JitterStats& jitter = game->jitter();
+        REQUIRE(jitter.samples == inputs.size());
+        REQUIRE(jitter.minNanos <= jitter.meanNanos());
+        REQUIRE(jitter.meanNanos() <= jitter.maxNanos);
+        REQUIRE(jitter.quantileNanos(0.5) <= jitter.quantileNanos(0.99));
+        REQUIRE(jitter.quantileNanos(1.0) == jitter.maxNanos);
+    }
+    cpu_set_t after;
+    REQUIRE(sched_getaffinity(0, sizeof(after), &after) == 0);
+    REQUIRE(CPU_EQUAL(&before, &after));
+
+#ifndef NDEBUG
+    // An allocation inside the hot path aborts a debug build
+    pid_t child = fork();
+    if (child == 0) {
+        std::signal(SIGABRT, SIG_DFL);  // bypass the test framework's crash reporting
+        std::freopen("/dev/null", "w", stderr);
+        NoAllocationScope noAllocation;
+        std::vector<int> forbidden(100);
+        _exit(forbidden.size() == 100 ? 0 : 1);
+    }
+    int status = 0;
+    REQUIRE(waitpid(child, &status, 0) == child);
+    REQUIRE(WIFSIGNALED(status));
+    REQUIRE(WTERMSIG(status) == SIGABRT);
+#endif
+}
+
+TEST_CASE("Huge page buffers hold tokens like ordinary vectors", "[hugepages]") {
+    PageBacking backing;
+    const size_t bytes = 3 * kHugePageSize + 123;
+    auto* raw = static_cast<unsigned char*>(allocateHugePages(bytes, backing));
+    if (backing != PageBacking::Normal) {
+        REQUIRE(reinterpret_cast<uintptr_t>(raw) % kHugePageSize == 0);
+    }
+    raw[0] = 1;
+    raw[bytes - 1] = 2;
+    REQUIRE(raw[0] + raw[bytes - 1] == 3);
+    freeHugePages(raw, bytes);
+
+    auto inputs = randomTokens(3000000, 100, 9);
+    HugeTokenVector huge(inputs.begin(), inputs.end());
+    REQUIRE(playState(huge.data(), huge.size()) == playState(inputs.data(), inputs.size()));
+    HugeTokenVector small{ 1, 1, 2, 3 };
+    small.push_back(5);
+    REQUIRE(playState(small.data(), 4) == (GameResult{ 13.0, 25.0 }));
+
+    // Counts whose byte size would wrap around are rejected instead of allocating too little
+    HugePageAllocator<GameState> allocator;
+    REQUIRE(allocator.max_size() < std::numeric_limits<size_t>::max() / sizeof(GameState));
+    REQUIRE_THROWS_AS(allocator.allocate(allocator.max_size() + 1), std::bad_array_new_length);
+    REQUIRE_THROWS_AS(allocator.allocate(std::numeric_limits<size_t>::max() / 2), std::bad_array_new_length);
+    REQUIRE_THROWS_AS(allocateHugePages(std::numeric_limits<size_t>::max(), backing), std::bad_alloc);
+
+    const HugePageStats& stats = hugePageStats();
+    REQUIRE(stats.hugeTlb + stats.transparentHuge + stats.normal >= 2);
+}
+
+TEST_CASE("Benchmark: game pass over huge page backed tokens", "[.][benchmark][hugepages]") {
+    // Defaults to 10^9 tokens (4 GB per buffer); ASAPHUS_BENCH_TOKENS overrides
+    const char* env = std::getenv("ASAPHUS_BENCH_TOKENS");
+    const size_t count = env != nullptr ? std::strtoull(env, nullptr, 10) : 1000000000ull;
+    auto timePass = [count](const uint32_t* tokens) {
+        auto start = std::chrono::steady_clock::now();
+        GameResult result = playState(tokens, count);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        REQUIRE(result.scoreA > 0);
+        return elapsed.count();
+    };
+    auto fill = [count](uint32_t* tokens) {
+        for (size_t i = 0; i < count; ++i) tokens[i] = static_cast<uint32_t>((i * 2654435761u) >> 22);
+    };
+    double normal, huge;
+    {
+        std::vector<uint32_t> tokens(count);
+        fill(tokens.data());
+        normal = timePass(tokens.data());
+    }
+    {
+        HugeTokenVector tokens(count);
+        fill(tokens.data());
+        huge = timePass(tokens.data());
+    }
+    std::cout << count << " tokens: normal pages " << normal << " s, huge pages " << huge
+        << " s (hugetlb " << hugePageStats().hugeTlb << ", transparent " << hugePageStats().transparentHuge
+        << ")" << std::endl;
+}
+
+/**
+ * Engine that crashes its process on the token 666, standing in for a bad input.
+ */
+GameResult playStateOrCrash(const uint32_t* input_weights, size_t count) {
+    if (std::find(input_weights, input_weights + count, 666u) != input_weights + count) {
+        std::abort();
+    }
+    return playState(input_weights, count);
+}
+
+TEST_CASE("Multi-process batch isolates crashing games", "[processes]") {
+    std::vector<std::vector<uint32_t> > games;
+    for (uint32_t seed = 0; seed < 60; ++seed) {
+        games.push_back(randomTokens(200 + seed, 100, seed));
+        if (seed % 17 == 5) games.back()[seed] = 666;
+    }
+    GameEngine crashy{ "crashy", playStateOrCrash, nullptr };
+
+    // A child the batch does not own must be left for its parent to reap
+    pid_t bystander = fork();
+    if (bystander == 0) _exit(7);
+    REQUIRE(bystander > 0);
+
+    ProcessBatchResult batch = playBatchInProcesses(games, crashy, 3);
+    int bystanderStatus = 0;
+    REQUIRE(waitpid(bystander, &bystanderStatus, 0) == bystander);
+    REQUIRE(WEXITSTATUS(bystanderStatus) == 7);
+    BatchStats expected;
+    for (size_t g = 0; g < games.size(); ++g) {
+        bool bad = g % 17 == 5;
+        REQUIRE(batch.failed[g] == bad);
+        if (!bad) {
+            REQUIRE(batch.results[g] == referenceScores(games[g]));
+            expected.add(batch.results[g], games[g].size());
+        }
+    }
+    REQUIRE(batch.restarts == 4);
+    REQUIRE(batch.stats.failed == 4);
+    REQUIRE(batch.stats.completed == expected.completed);
+    REQUIRE(batch.stats.tokens == expected.tokens);
+    REQUIRE(batch.stats.winsA + batch.stats.winsB + batch.stats.ties == expected.completed);
+    REQUIRE(batch.stats.totalScoreA == Approx(expected.totalScoreA));
+
+    ProcessBatchResult empty = playBatchInProcesses({}, gameEngines()[1], 2);
+    REQUIRE(empty.results.empty());
+    REQUIRE(empty.restarts == 0);
+}
+
+TEST_CASE("Benchmark: process batch against thread batch", "[.][benchmark][processes]") {
+    std::vector<std::vector<uint32_t> > games;
+    for (uint32_t seed = 0; seed < 2000; ++seed) games.push_back(randomTokens(20000, 1000, seed));
+    const GameEngine& engine = *findEngine("state");
+    auto time = [](const std::function<void()>& fn) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    double threads = time([&] { playBatch(games, engine); });
+    double processes = time([&] { playBatchInProcesses(games, engine); });
+    std::cout << games.size() << " games: threads " << threads << " s, processes " << processes << " s" << std::endl;
+}
+
+TEST_CASE("Partitioned runs merge into the unpartitioned result", "[partition]") {
+    std::string dir = "/tmp/asaphus_partition_test_" + std::to_string(::getpid());
+    REQUIRE(mkdir(dir.c_str(), 0700) == 0);
+    std::string manifest = dir + "/manifest.txt";
+    std::vector<std::vector<uint32_t> > games;
+    {
+        std::ofstream list(manifest);
+        for (uint32_t id = 0; id < 23; ++id) {
+            games.push_back(randomTokens(100 + id * 10, 300, id));
+            std::string file = dir + "/game" + std::to_string(id) + ".bin";
+            writeTokenFile(file, games.back());
+            list << file << "\n";
+        }
+    }
+
+    // Each shard runs in its own process and leaves its partial result in a file
+    const uint32_t shards = 3;
+    std::vector<std::string> paths;
+    for (uint32_t shard = 0; shard < shards; ++shard) {
+        paths.push_back(dir + "/partial" + std::to_string(shard) + ".bin");
+        pid_t pid = fork();
+        if (pid == 0) {
+            writePartial(paths.back(), runShard(manifest, shard, shards, *findEngine("state"), 1));
+            _exit(0);
+        }
+        int status = 0;
+        REQUIRE(waitpid(pid, &status, 0) == pid);
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(WEXITSTATUS(status) == 0);
+    }
+
+    std::vector<PartialResult> partials;
+    for (auto it = paths.rbegin(); it != paths.rend(); ++it) partials.push_back(readPartial(*it));
+    PartialResult merged = mergePartials(partials);
+    PartialResult whole = mergePartials({ runShard(manifest, 0, 1, *findEngine("reference")) });
+
+    REQUIRE(merged.records.size() == games.size());
+    for (size_t id = 0; id < games.size(); ++id) {
+        REQUIRE(merged.records[id].id == id);
+        REQUIRE(merged.records[id].length == games[id].size());
+        REQUIRE(merged.records[id].scoreA == referenceScores(games[id]).scoreA);
+        REQUIRE(merged.records[id].scoreB == whole.records[id].scoreB);
+        REQUIRE(merged.records[id].fingerprint == whole.records[id].fingerprint);
+    }
+    REQUIRE(merged.stats.totalScoreA == whole.stats.totalScoreA);
+    REQUIRE(merged.stats.tokens == whole.stats.tokens);
+    REQUIRE(merged.stats.winsB == whole.stats.winsB);
+    REQUIRE(std::memcmp(&merged.margins, &whole.margins, sizeof(MarginSketch)) == 0);
+
+    std::string mergedPath = dir + "/merged.bin";
+    writePartial(mergedPath, merged);
+    PartialResult reread = readPartial(mergedPath);
+    REQUIRE(reread.records.size() == games.size());
+    REQUIRE(batchFingerprint(reread.records) == batchFingerprint(whole.records));
+    REQUIRE(reread.stats.totalScoreB == merged.stats.totalScoreB);
+    REQUIRE(reread.stats.ties == merged.stats.ties);
+    REQUIRE(std::memcmp(&reread.margins, &merged.margins, sizeof(MarginSketch)) == 0);
+    REQUIRE_THROWS_AS(mergePartials({ partials[0], partials[1] }), std::runtime_error);
+    REQUIRE_THROWS_AS(mergePartials({ partials[0], partials[0], partials[1] }), std::runtime_error);
+    PartialResult foreign = partials[0];
+    foreign.shard = 7;
+    REQUIRE_THROWS_AS(mergePartials({ foreign, partials[1], partials[2] }), std::runtime_error);
+
+    // Corrupt files are rejected before their counts are trusted
+    auto patched = [&](size_t offset, uint64_t value) {
+        std::fstream file(mergedPath, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(static_cast<std::streamoff>(offset));
+        file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+    patched(24, uint64_t(1) << 60);  // record count
+    REQUIRE_THROWS_AS(readPartial(mergedPath), std::runtime_error);
+    writePartial(mergedPath, merged);
+    patched(8, uint64_t(9) | uint64_t(4) << 32);  // shard 9 of 4
+    REQUIRE_THROWS_AS(readPartial(mergedPath), std::runtime_error);
+    writePartial(mergedPath, merged);
+    REQUIRE(::truncate(mergedPath.c_str(), 100) == 0);
+    REQUIRE_THROWS_AS(readPartial(mergedPath), std::runtime_error);
+
+    for (size_t id = 0; id < games.size(); ++id) std::remove((dir + "/game" + std::to_string(id) + ".bin").c_str());
+    for (const auto& path : paths) std::remove(path.c_str());
+    std::remove(mergedPath.c_str());
+    std::remove(manifest.c_str());
+    rmdir(dir.c_str());
+}
+
+TEST_CASE("Windowed blue box scores the extremes of the last W weights", "[windowed]") {
+    std::mt19937 rng(88);
+    std::uniform_real_distribution<double> weight(0.0, 50.0);
+    for (size_t window : { 1, 2, 3, 17, 200 }) {
+        auto box = Box::makeWindowedBlueBox(0.5, window);
+        std::vector<double> absorbed;
+        for (int i = 0; i < 500; ++i) {
+            // Repeated values exercise ties in the monotonic deques
+            double w = i % 7 == 0 && !absorbed.empty() ? absorbed.back() : std::floor(weight(rng));
+            absorbed.push_back(w);
+            auto first = absorbed.end() - std::min(window, absorbed.size());
+            double expected = cantorPairing(*std::min_element(first, absorbed.end()),
+                *std::max_element(first, absorbed.end()));
+            REQUIRE(box->previewScore(w) == expected);
+            REQUIRE(box->absorb(w) == expected);
+        }
+        REQUIRE(box->getWeight() == std::accumulate(absorbed.begin(), absorbed.end(), 0.5));
+    }
+
+    // A window longer than the game behaves like the unbounded blue box
+    auto windowed = Box::makeWindowedBlueBox(0.2, 1000000);
+    auto blue = Box::makeBlueBox(0.2);
+    for (uint32_t token : randomTokens(5000, 100, 7)) {
+        REQUIRE(windowed->absorb(token) == blue->absorb(token));
+    }
+    REQUIRE_THROWS_AS(Box::makeWindowedBlueBox(0.0, 0), std::invalid_argument);
+}
+
+TEST_CASE("Windowed quantile box matches sorting the window", "[windowed]") {
+    std::mt19937 rng(89);
+    std::uniform_int_distribution<int> weight(0, 40);
+    for (size_t window : { 1, 2, 3, 5, 64 }) {
+        for (double q : { 0.0, 0.5, 0.9, 1.0 }) {
+            auto box = Box::makeWindowedQuantileBox(0.1, window, q);
+            std::vector<double> absorbed;
+            for (int i = 0; i < 300; ++i) {
+                double w = weight(rng);
+                absorbed.push_back(w);
+                std::vector<double> sorted(absorbed.end() - std::min(window, absorbed.size()), absorbed.end());
+                std::sort(sorted.begin(), sorted.end());
+                double h = q * (sorted.size() - 1);
+                size_t lower = static_cast<size_t>(h);
+                double value = sorted[lower];
+                if (lower + 1 < sorted.size()) value += (h - lower) * (sorted[lower + 1] - value);
+                REQUIRE(box->previewScore(w) == value * value);
+                REQUIRE(box->absorb(w) == value * value);
+            }
+        }
+    }
+
+    // Median of the last three weights of 1, 5, 2, 9 is 5
+    auto median = Box::makeWindowedQuantileBox(0.0, 3, 0.5);
+    for (double w : { 1.0, 5.0, 2.0 }) median->absorb(w);
+    REQUIRE(median->absorb(9.0) == 25.0);
+    REQUIRE_THROWS_AS(Box::makeWindowedQuantileBox(0.0, 3, 1.5), std::invalid_argument);
+    REQUIRE_THROWS_AS(Box::makeWindowedQuantileBox(0.0, 0, 0.5), std::invalid_argument);
+}
+
+TEST_CASE("Dynamic roster keeps selecting like play() while boxes come and go", "[roster]") {
+    std::mt19937 rng(90);
+    auto roster = randomRoster(200, 90);
+    DynamicRosterGame game(roster);
+    // Reference: boxes vector in insertion order, new boxes appended, retired ones erased
+    auto boxes = makeBoxes(roster);
+    std::vector<DynamicRosterGame::BoxId> ids(roster.size());
+    std::iota(ids.begin(), ids.end(), DynamicRosterGame::BoxId(0));
+    double scores[2] = { 0.0, 0.0 };
+    size_t largest = ids.size(), added = ids.size();
+
+    for (int turn = 0; turn < 20000; ++turn) {
+        if (rng() % 8 == 0) {
+            BoxSpec spec = randomRoster(1, rng())[0];
+            spec.initialWeight += game.weight(ids[rng() % ids.size()]);
+            ids.push_back(game.addBox(spec));
+            boxes.push_back(std::move(makeBoxes({ spec })[0]));
+            largest = std::max(largest, ids.size());
+            ++added;
+        }
+        if (rng() % 8 == 0 && ids.size() > 1) {
+            size_t victim = rng() % ids.size();
+            game.removeBox(ids[victim]);
+            REQUIRE_FALSE(game.contains(ids[victim]));
+            ids.erase(ids.begin() + victim);
+            boxes.erase(boxes.begin() + victim);
+        }
+        uint32_t token = rng() % 30;
+        auto lightest = std::min_element(boxes.begin(), boxes.end(),
+            [](const std::unique_ptr<Box>& lhs, const std::unique_ptr<Box>& rhs) { return *lhs < *rhs; });
+        scores[turn % 2] += (*lightest)->absorb(token);
+        REQUIRE(game.step(token) == ids[lightest - boxes.begin()]);
+    }
+    REQUIRE(game.size() == ids.size());
+    REQUIRE(game.result() == (GameResult{ scores[0], scores[1] }));
+    for (size_t i = 0; i < ids.size(); ++i) REQUIRE(game.weight(ids[i]) == boxes[i]->getWeight());
+    // Retired slots were handed out again, so slots stay below the largest roster size
+    REQUIRE(added > largest);
+    for (auto id : ids) REQUIRE(DynamicRosterGame::slotOf(id) < largest);
+
+    // The id of a retired box does not address the box that reuses its slot
+    DynamicRosterGame::BoxId stale = ids.back();
+    double weight = game.weight(ids.front());
+    game.removeBox(stale);
+    DynamicRosterGame::BoxId reused = game.addBox({ BoxKind::Green, 1.0 });
+    REQUIRE(DynamicRosterGame::slotOf(reused) == DynamicRosterGame::slotOf(stale));
+    REQUIRE(reused != stale);
+    REQUIRE(game.contains(reused));
+    REQUIRE_FALSE(game.contains(stale));
+    REQUIRE_THROWS_AS(game.weight(stale), std::out_of_range);
+    REQUIRE_THROWS_AS(game.removeBox(stale), std::out_of_range);
+    REQUIRE(game.weight(ids.front()) == weight);
+
+    REQUIRE_THROWS_AS(game.removeBox(1000000), std::out_of_range);
+    DynamicRosterGame empty;
+    REQUIRE_THROWS_AS(empty.step(1), std::logic_error);
+}
+
+TEST_CASE("Rebasing keeps selection exact for unbounded weights", "[rebase]") {
+    // Beyond 2^53 per box, unrebased double weights can no longer add odd tokens exactly
+    std::vector<uint32_t> inputs(12000000, 4000000000u);
+    for (size_t i = 0; i < inputs.size(); i += 3) inputs[i] -= static_cast<uint32_t>(i % 7);
+    auto boxes = makeStandardBoxes();
+    auto scores = playWithStrategies(inputs, boxes, nullptr, nullptr);
+    REQUIRE(GameResult{ scores.first, scores.second } == playState(inputs.data(), inputs.size()));
+    REQUIRE(GameResult{ scores.first, scores.second } == playLanes(inputs.data(), inputs.size()));
+    uint64_t total = std::accumulate(inputs.begin(), inputs.end(), uint64_t(0));
+    uint64_t offsets = 0;
+    for (const auto& box : boxes) {
+        REQUIRE(box->getWeightOffset() == boxes[0]->getWeightOffset());
+        REQUIRE(box->getRelativeWeight() < 2 * kRebaseThreshold);
+        offsets += box->getWeightOffset() + static_cast<uint64_t>(box->getRelativeWeight());
+    }
+    REQUIRE(offsets == total);
+    REQUIRE(boxes[0]->getWeightOffset() > 0);
 
+    // GameState moves the common minimum into base before absorbed * 10 overflows
+    GameState state;
+    for (int box = 0; box < 4; ++box) state.absorbed[box] = GameState::kRebaseLimit - 10 + box;
+    GameState unrebased = state;
+    int box = state.selectBox();
+    state.step(100);
+    REQUIRE(state.base == GameState::kRebaseLimit - 9);
+    REQUIRE(state.absorbed[1] == 0);
+    REQUIRE(state.weight(box) == kStandardInitialWeights[box] + static_cast<double>(unrebased.absorbed[box] + 100));
+
+    LaneBlock block;
+    for (int b = 0; b < 4; ++b) block.absorbed[b][3] = int64_t(1) << 58 | b;
+    rebaseLanes(block);
+    REQUIRE(block.absorbed[2][3] == 2);
+    REQUIRE(block.absorbed[2][0] == 0);
+}
+
+TEST_CASE("Session table plays many games by id and spills idle ones", "[sessions]") {
+    std::string spillPath = "/tmp/asaphus_sessions_test_" + std::to_string(::getpid());
+    SessionTable table(spillPath);
+    std::unordered_map<uint64_t, GameState> expected;
+    std::mt19937_64 rng(92);
+    for (int i = 0; i < 20000; ++i) {
+        uint64_t id = rng();
+        REQUIRE(table.create(id));
+        expected[id] = GameState();
+    }
+    REQUIRE_FALSE(table.create(expected.begin()->first));
+
+    std::vector<uint64_t> ids;
+    for (const auto& e : expected) ids.push_back(e.first);
+    std::sort(ids.begin(), ids.end());
+    for (int round = 0; round < 6; ++round) {
+        for (int i = 0; i < 30000; ++i) {
+            uint64_t id = ids[rng() % ids.size()];
+            uint32_t token = static_cast<uint32_t>(rng() % 4000000000u);
+            REQUIRE(table.step(id, token) == expected[id].step(token));
+        }
+        if (round % 2 == 1) {
+            size_t spilled = table.spillIdle(20000);
+            REQUIRE(spilled > 0);
+            REQUIRE(table.spilledCount() >= spilled);
+        }
+        // Retire some sessions, including spilled ones
+        for (int i = 0; i < 500; ++i) {
+            size_t victim = rng() % ids.size();
+            REQUIRE(table.erase(ids[victim]));
+            expected.erase(ids[victim]);
+            ids[victim] = ids.back();
+            ids.pop_back();
+        }
+    }
+
+    REQUIRE(table.size() == expected.size());
+    for (const auto& e : expected) {
+        GameState state = table.state(e.first);
+        REQUIRE(sameBoxes(state, [&e] { GameState s = e.second; s.normalize(); return s; }()));
+        REQUIRE(state.turn == e.second.turn);
+        REQUIRE(state.scores[0] == e.second.scores[0]);
+        REQUIRE(state.scores[1] == e.second.scores[1]);
+        for (int box = 0; box < 4; ++box) REQUIRE(state.weight(box) == e.second.weight(box));
+    }
+    REQUIRE(table.spilledCount() == 0);
+    REQUIRE_FALSE(table.erase(1));
+    REQUIRE_THROWS_AS(table.step(1, 1), std::out_of_range);
+    REQUIRE_THROWS_AS(SessionTable().spillIdle(0), std::logic_error);
+}
+
+TEST_CASE("Benchmark: session table memory and lookup latency", "[.][benchmark][sessions]") {
+    // Defaults to 10^6 sessions; ASAPHUS_BENCH_SESSIONS overrides
+    const char* env = std::getenv("ASAPHUS_BENCH_SESSIONS");
+    const size_t count = env != nullptr ? std::strtoull(env, nullptr, 10) : 1000000;
+    SessionTable table;
+    std::mt19937_64 rng(92);
+    std::vector<uint64_t> ids(count);
+    for (auto& id : ids) {
+        id = rng();
+        table.create(id);
+    }
+    const size_t lookups = 5000000;
+    std::vector<uint64_t> order(lookups);
+    for (auto& id : order) id = ids[rng() % count];
+    auto start = std::chrono::steady_clock::now();
+    double total = 0;
+    for (size_t i = 0; i < lookups; ++i) total += table.step(order[i], static_cast<uint32_t>(i & 1023));
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    REQUIRE(total > 0);
+
+    size_t boxesBytes = sizeof(std::vector<std::unique_ptr<Box> >) + 4 * sizeof(std::unique_ptr<Box>)
+        + 2 * sizeof(GreenBox) + 2 * sizeof(BlueBox) + 2 * sizeof(Player);
+    std::cout << count << " sessions: " << double(table.memoryBytes()) / count << " bytes per session (boxes and "
+        << "players: at least " << boxesBytes << " plus window vectors), step with lookup "
+        << elapsed.count() * 1e9 / lookups << " ns" << std::endl;
+}
+
+TEST_CASE("Batched session stepping matches stepping one request at a time", "[sessions]") {
+    SessionTable single, batched;
+    std::mt19937_64 rng(93);
+    std::vector<uint64_t> ids(3000);
+    for (auto& id : ids) {
+        id = rng();
+        single.create(id);
+        batched.create(id);
+    }
+    for (size_t batchSize : { 1, 7, 64, 5000 }) {
+        std::vector<SessionToken> requests(batchSize);
+        for (auto& request : requests) {
+            // Few hot sessions, so batches repeat sessions
+            request.session = ids[rng() % 4 == 0 ? rng() % 5 : rng() % ids.size()];
+            request.token = static_cast<uint32_t>(rng() % 1000);
+        }
+        std::vector<double> scores(batchSize);
+        batched.stepBatch(requests.data(), requests.size(), scores.data());
+        for (size_t i = 0; i < batchSize; ++i) {
+            REQUIRE(scores[i] == single.step(requests[i].session, requests[i].token));
+        }
+    }
+    for (uint64_t id : ids) {
+        GameState expected = single.state(id), actual = batched.state(id);
+        REQUIRE(sameBoxes(actual, expected));
+        REQUIRE(actual.turn == expected.turn);
+        REQUIRE(actual.scores[0] == expected.scores[0]);
+        REQUIRE(actual.scores[1] == expected.scores[1]);
+        REQUIRE(actual.fingerprint == expected.fingerprint);
+    }
+    SessionToken unknown{ 1, 1 };
+    REQUIRE_THROWS_AS(batched.stepBatch(&unknown, 1), std::out_of_range);
+}
+
+TEST_CASE("Benchmark: batched against single session steps", "[.][benchmark][sessions]") {
+    const size_t count = 1000000;
+    SessionTable table;
+    std::mt19937_64 rng(93);
+    std::vector<uint64_t> ids(count);
+    for (auto& id : ids) {
+        id = rng();
+        table.create(id);
+    }
+    std::vector<SessionToken> requests(4000000);
+    for (auto& request : requests) request = { ids[rng() % count], static_cast<uint32_t>(rng() % 1024) };
+    auto time = [](const std::function<void()>& fn) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    double single = time([&] {
+        for (const auto& request : requests) table.step(request.session, request.token);
+    });
+    double batched = time([&] {
+        for (size_t first = 0; first < requests.size(); first += 4096) {
+            table.stepBatch(&requests[first], std::min<size_t>(4096, requests.size() - first));
+        }
+    });
+    std::cout << requests.size() << " requests over " << count << " sessions: single " << single * 1e9 / requests.size()
+        << " ns, batched " << batched * 1e9 / requests.size() << " ns per request" << std::endl;
+}
+
+/**
+ * Same operation sequence for the durable table and its in-memory reference.
+ */
+std::vector<WalRecord> randomSessionOps(size_t count, uint32_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<WalRecord> ops;
+    std::vector<uint64_t> live;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t roll = rng() % 100;
+        if (live.empty() || roll < 5) {
+            live.push_back(rng());
+            ops.push_back({ live.back(), 0, WalOp::Create, 0 });
+        }
+        else if (roll < 7) {
+            size_t victim = rng() % live.size();
+            ops.push_back({ live[victim], 0, WalOp::Erase, 0 });
+            live[victim] = live.back();
+            live.pop_back();
+        }
+        else {
+            ops.push_back({ live[rng() % live.size()], static_cast<uint32_t>(rng() % 1000), WalOp::Step, 0 });
+        }
+    }
+    return ops;
+}
+
+template <typename Table>
+void applySessionOp(Table& table, const WalRecord& op) {
+    if (op.op == WalOp::Create) table.create(op.session);
+    if (op.op == WalOp::Erase) table.erase(op.session);
+    if (op.op == WalOp::Step) table.step(op.session, op.token);
+}
+
+TEST_CASE("Session log recovers synced operations after a crash", "[wal]") {
+    std::string dir = "/tmp/asaphus_wal_test_" + std::to_string(::getpid());
+    REQUIRE(mkdir(dir.c_str(), 0700) == 0);
+    auto ops = randomSessionOps(20000, 94);
+    const size_t synced = 15000;
+    WalConfig config;
+    config.groupRecords = 256;
+    config.maxDelay = std::chrono::microseconds(500);
+
+    // The child checkpoints halfway, syncs, then dies without flushing the last operations
+    pid_t pid = fork();
+    if (pid == 0) {
+        DurableSessionTable table(dir, config);
+        for (size_t i = 0; i < ops.size(); ++i) {
+            applySessionOp(table, ops[i]);
+            if (i == 8000) table.checkpoint();
+            if (i + 1 == synced) table.sync();
+        }
+        _exit(0);
+    }
+    int status = 0;
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    REQUIRE(WIFEXITED(status));
+
+    // The checkpoint rotated the log: only the segment after it is left
+    std::vector<uint64_t> segments = DurableSessionTable::logSegments(dir);
+    REQUIRE(segments.size() == 1);
+    REQUIRE(segments[0] > 8000);
+
+    // A torn record at the end is ignored
+    {
+        std::ofstream log(DurableSessionTable::logSegmentPath(dir, segments[0]), std::ios::binary | std::ios::app);
+        log.write("torn", 4);
+    }
+    auto sameSessions = [](DurableSessionTable& recovered, const std::vector<WalRecord>& ops, size_t applied) {
+        SessionTable expected;
+        for (size_t i = 0; i < applied; ++i) applySessionOp(expected, ops[i]);
+        REQUIRE(recovered.sessions().size() == expected.size());
+        recovered.sessions().forEachSession([&expected](uint64_t id, const GameState& state) {
+            GameState reference = expected.state(id);
+            REQUIRE(sameBoxes(state, reference));
+            REQUIRE(state.turn == reference.turn);
+            REQUIRE(state.scores[0] == reference.scores[0]);
+            REQUIRE(state.scores[1] == reference.scores[1]);
+            REQUIRE(state.fingerprint == reference.fingerprint);
+        });
+    };
+    size_t recoveredOps;
+    {
+        DurableSessionTable recovered(dir, config);
+        recoveredOps = recovered.log().appended();
+        REQUIRE(recoveredOps >= synced);
+        REQUIRE(recoveredOps <= ops.size());
+        sameSessions(recovered, ops, recoveredOps);
+
+        // A clean shutdown commits everything
+        auto more = randomSessionOps(30000, 94);
+        for (size_t i = recoveredOps; i < more.size(); ++i) applySessionOp(recovered, more[i]);
+        ops = more;
+    }
+    {
+        DurableSessionTable reopened(dir, config);
+        REQUIRE(reopened.log().appended() == ops.size());
+        sameSessions(reopened, ops, ops.size());
+        REQUIRE(reopened.checkpoint() == ops.size());
+    }
+    REQUIRE(DurableSessionTable::logSegments(dir) == std::vector<uint64_t>{ ops.size() });
+    {
+        DurableSessionTable fromSnapshot(dir, config);
+        sameSessions(fromSnapshot, ops, ops.size());
+    }
+    auto removeAll = [&dir] {
+        for (uint64_t first : DurableSessionTable::logSegments(dir)) {
+            std::remove(DurableSessionTable::logSegmentPath(dir, first).c_str());
+        }
+        for (const char* file : { "/sessions.wal", "/sessions.snapshot" }) std::remove((dir + file).c_str());
+    };
+    auto writeVersionOneSnapshot = [&dir](uint64_t covered) {
+        std::ofstream snapshot(dir + "/sessions.snapshot", std::ios::binary | std::ios::trunc);
+        const uint32_t header[2] = { 0x4e535341, 1 };
+        const uint64_t counts[2] = { covered, 0 };
+        snapshot.write(reinterpret_cast<const char*>(header), sizeof(header));
+        snapshot.write(reinterpret_cast<const char*>(counts), sizeof(counts));
+    };
+
+    // A version 1 snapshot has no fingerprints and needs the whole log, which is gone here
+    writeVersionOneSnapshot(ops.size());
+    REQUIRE_THROWS_AS(DurableSessionTable(dir, config), std::runtime_error);
+
+    // Version 1 tables kept their whole log in sessions.wal, which is replayed from 0
+    removeAll();
+    {
+        DurableSessionTable table(dir, config);
+        for (const auto& op : ops) applySessionOp(table, op);
+    }
+    REQUIRE(std::rename(DurableSessionTable::logSegmentPath(dir, 0).c_str(), (dir + "/sessions.wal").c_str()) == 0);
+    writeVersionOneSnapshot(ops.size());
+    {
+        DurableSessionTable migrated(dir, config);
+        sameSessions(migrated, ops, ops.size());
+        REQUIRE(migrated.checkpoint() == ops.size());
+    }
+    REQUIRE(::access((dir + "/sessions.wal").c_str(), F_OK) != 0);
+    REQUIRE(DurableSessionTable::logSegments(dir) == std::vector<uint64_t>{ ops.size() });
+    DurableSessionTable fromMigrated(dir, config);
+    sameSessions(fromMigrated, ops, ops.size());
+
+    removeAll();
+    rmdir(dir.c_str());
+}
+
+TEST_CASE("Session log stays failed after a write error", "[wal]") {
+    std::string path = "/tmp/asaphus_wal_error_" + std::to_string(::getpid());
+    std::remove(path.c_str());
+    WalConfig config;
+    config.groupRecords = 1 << 20;
+    config.maxDelay = std::chrono::seconds(10);
+    // A file size limit makes the second batch fail halfway through
+    auto previousHandler = std::signal(SIGXFSZ, SIG_IGN);
+    rlimit limit;
+    REQUIRE(getrlimit(RLIMIT_FSIZE, &limit) == 0);
+    rlimit small = limit;
+    small.rlim_cur = 100 * sizeof(WalRecord) + 10;
+    {
+        WriteAheadLog log(path, config);
+        for (uint32_t i = 0; i < 50; ++i) log.append(WalOp::Step, i, i);
+        log.sync();
+        REQUIRE(setrlimit(RLIMIT_FSIZE, &small) == 0);
+        uint64_t last = 0;
+        for (uint32_t i = 0; i < 80; ++i) last = log.append(WalOp::Step, i, i);
+        REQUIRE_THROWS_AS(log.sync(), std::system_error);
+        REQUIRE(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+
+        // There is room again, but nothing after the failure may become durable
+        REQUIRE_THROWS_AS(log.append(WalOp::Step, 1, 1), std::system_error);
+        REQUIRE_THROWS_AS(log.waitDurable(last), std::system_error);
+        REQUIRE_THROWS_AS(log.sync(), std::system_error);
+        REQUIRE(log.durable() == 50);
+    }
+    std::signal(SIGXFSZ, previousHandler);
+    struct stat info;
+    REQUIRE(::stat(path.c_str(), &info) == 0);
+    REQUIRE(info.st_size == static_cast<off_t>(50 * sizeof(WalRecord)));
+    REQUIRE(WriteAheadLog::replay(path, 0, [](const WalRecord&) {}) == 50);
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Benchmark: durable session steps with group commit", "[.][benchmark][wal]") {
+    std::string dir = "/tmp/asaphus_wal_bench_" + std::to_string(::getpid());
+    REQUIRE(mkdir(dir.c_str(), 0700) == 0);
+    const size_t sessions = 100000, steps = 5000000;
+    std::mt19937_64 rng(94);
+    std::vector<SessionToken> requests(steps);
+    for (auto& request : requests) request = { rng() % sessions, static_cast<uint32_t>(rng() % 1000) };
+    for (auto delay : { 100, 1000, 10000 }) {
+        WalConfig config;
+        config.maxDelay = std::chrono::microseconds(delay);
+        uint64_t commits;
+        double elapsed;
+        {
+            DurableSessionTable table(dir, config);
+            for (uint64_t id = 0; id < sessions; ++id) table.create(id);
+            auto start = std::chrono::steady_clock::now();
+            for (const auto& request : requests) table.step(request.session, request.token);
+            table.sync();
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            commits = table.log().commits();
+        }
+        std::cout << "max delay " << delay << " us: " << steps / elapsed << " durable tokens/s, "
+            << commits << " group commits" << std::endl;
+        std::remove(DurableSessionTable::logSegmentPath(dir, 0).c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+TEST_CASE("Streaming pipeline scores like play()", "[streaming]") {
+    for (size_t capacity : { 1, 3, 4096 }) {
+        for (uint32_t seed = 0; seed < 4; ++seed) {
+            auto inputs = randomTokens(2000 + seed * 777, seed % 2 ? 100 : 4000000000u, seed);
+            REQUIRE(playStreaming(inputs.data(), inputs.size(), capacity) == referenceScores(inputs));
+        }
+    }
+    StreamingGame game(16);
+    for (uint32_t token : { 1, 1, 2, 3, 5, 8, 13, 21 }) game.push(token);
+    // An idle stream blocks its threads instead of spinning
+    auto cpuSeconds = [] {
+        timespec now;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+        return now.tv_sec + now.tv_nsec * 1e-9;
+    };
+    double before = cpuSeconds();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    REQUIRE(cpuSeconds() - before < 0.1);
+    REQUIRE(game.finish() == (GameResult{ 155.0, 366.25 }));
+    REQUIRE(playStreaming(nullptr, 0) == GameResult());
+}
+
+TEST_CASE("Benchmark: streaming pipeline against one thread", "[.][benchmark][streaming]") {
+    auto inputs = randomTokens(20000000, 1000, 95);
+    auto time = [](const std::function<GameResult()>& fn) {
+        auto start = std::chrono::steady_clock::now();
+        GameResult result = fn();
+        REQUIRE(result.scoreA > 0);
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    double single = time([&] { return playState(inputs.data(), inputs.size()); });
+    double streaming = time([&] { return playStreaming(inputs.data(), inputs.size()); });
+    std::cout << inputs.size() << " tokens on " << defaultThreadCount() << " cores: one thread "
+        << inputs.size() / single << " tokens/s, streaming " << inputs.size() / streaming << " tokens/s" << std::endl;
+}
+
+TEST_CASE("Leave-one-out deltas match replaying without each token", "[influence]") {
+    for (uint32_t maxWeight : { 3u, 100u }) {
+        auto inputs = randomTokens(1500, maxWeight, maxWeight);
+        LeaveOneOutAnalysis analysis = leaveOneOut(inputs, 3);
+        REQUIRE(analysis.full == referenceScores(inputs));
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            std::vector<uint32_t> without(inputs);
+            without.erase(without.begin() + i);
+            GameResult expected = referenceScores(without);
+            REQUIRE(analysis.full.scoreA + analysis.deltaA[i] == Approx(expected.scoreA).epsilon(1e-12));
+            REQUIRE(analysis.full.scoreB + analysis.deltaB[i] == Approx(expected.scoreB).epsilon(1e-12));
+        }
+        REQUIRE(analysis.simulatedTurns < inputs.size() * (inputs.size() - 1) / 2);
+    }
+    LeaveOneOutAnalysis single = leaveOneOut({ 7 });
+    REQUIRE(single.deltaA[0] == -49.0);
+    REQUIRE(single.deltaB[0] == 0.0);
+    REQUIRE(leaveOneOut({}).deltaA.empty());
+}
+
+TEST_CASE("Benchmark: leave-one-out analysis", "[.][benchmark][influence]") {
+    // Defaults to 10^5 tokens; ASAPHUS_BENCH_TOKENS overrides
+    const char* env = std::getenv("ASAPHUS_BENCH_TOKENS");
+    const size_t count = env != nullptr ? std::strtoull(env, nullptr, 10) : 100000;
+    for (uint32_t maxWeight : { 10u, 100u, 1000u }) {
+        auto inputs = randomTokens(count, maxWeight, 96);
+        auto start = std::chrono::steady_clock::now();
+        LeaveOneOutAnalysis analysis = leaveOneOut(inputs);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << count << " tokens up to " << maxWeight << ": " << elapsed.count() << " s, "
+            << double(analysis.simulatedTurns) / count << " turns simulated per position" << std::endl;
+    }
+}
+
+TEST_CASE("Ordering search evaluates moves incrementally and improves the margin", "[ordering]") {
+    auto tokens = randomTokens(700, 60, 97);
+    OrderingChain chain(tokens);
+    std::vector<uint32_t> order = tokens;
+    std::mt19937 rng(97);
+    for (int i = 0; i < 400; ++i) {
+        OrderingMove move{ i % 2 ? OrderingMove::Swap : OrderingMove::Insert, rng() % order.size(), rng() % order.size() };
+        if (move.from == move.to) continue;
+        std::vector<uint32_t> moved = order;
+        if (move.kind == OrderingMove::Swap) {
+            std::swap(moved[move.from], moved[move.to]);
+        }
+        else {
+            uint32_t token = moved[move.from];
+            moved.erase(moved.begin() + move.from);
+            moved.insert(moved.begin() + move.to, token);
+        }
+        GameResult expected = referenceScores(moved);
+        REQUIRE(chain.evaluate(move) == Approx(expected.scoreA - expected.scoreB).epsilon(1e-12));
+        if (rng() % 3 == 0) {
+            chain.accept();
+            order = moved;
+            REQUIRE(chain.tokens() == order);
+        }
+    }
+
+    OrderingSearchConfig config;
+    config.chains = 3;
+    config.iterations = 3000;
+    OrderingSearchResult result = optimizeOrdering(tokens, config);
+    REQUIRE(result.evaluations >= config.chains * config.iterations);
+    REQUIRE(result.bestMargin > result.initialMargin);
+    GameResult best = referenceScores(result.bestOrder);
+    REQUIRE(best.scoreA - best.scoreB == result.bestMargin);
+    std::vector<uint32_t> sortedBest = result.bestOrder, sortedTokens = tokens;
+    std::sort(sortedBest.begin(), sortedBest.end());
+    std::sort(sortedTokens.begin(), sortedTokens.end());
+    REQUIRE(sortedBest == sortedTokens);
+}
+
+TEST_CASE("Benchmark: ordering search margin against evaluation rate", "[.][benchmark][ordering]") {
+    auto tokens = randomTokens(10000, 1000, 97);
+    auto start = std::chrono::steady_clock::now();
+    const int replays = 200;
+    for (int i = 0; i < replays; ++i) playState(tokens.data(), tokens.size());
+    double replayRate = replays / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (uint64_t iterations : { 10000, 100000, 400000 }) {
+        OrderingSearchConfig config;
+        config.iterations = iterations;
+        OrderingSearchResult result = optimizeOrdering(tokens, config);
+        std::cout << iterations << " iterations per chain: margin " << result.initialMargin << " -> " << result.bestMargin
+            << ", " << result.evaluationsPerSecond << " evaluations/s (full replays: " << replayRate << "/s)" << std::endl;
+    }
+}
+
+namespace {
+
+std::vector<ArchiveRow> archiveTestRows(size_t count, uint32_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<ArchiveRow> rows;
+    for (size_t i = 0; i < count; ++i) {
+        ArchiveRow row;
+        row.id = i;
+        row.length = i / 64 + rng() % 100;  // grows with the id, as in a sorted manifest
+        row.scoreA = static_cast<double>(rng() % 1000000) / 8;
+        row.scoreB = static_cast<double>(rng() % 1000000) / 8;
+        row.margin = row.scoreA - row.scoreB;
+        row.roster = static_cast<uint32_t>(rng() % 3);
+        rows.push_back(row);
+    }
+    return rows;
+}
+
+}  // namespace
+
+TEST_CASE("Result archive queries skip blocks by zone map and filter the rest", "[archive]") {
+    std::string path = "/tmp/asaphus_archive_test_" + std::to_string(::getpid());
+    auto rows = archiveTestRows(3 * kArchiveBlockRows + 1234, 98);
+    {
+        ResultArchiveWriter writer(path);
+        for (const auto& row : rows) writer.append(GameRecord{ row.id, row.length, row.scoreA, row.scoreB, 0 }, row.roster);
+        writer.close();
+        REQUIRE(writer.rows() == rows.size());
+    }
+
+    ResultArchive archive(path);
+    REQUIRE(archive.rows() == rows.size());
+    REQUIRE(archive.blocks() == 4);
+    REQUIRE(archive.zoneMap(1).id.low == kArchiveBlockRows);
+    REQUIRE(archive.zoneMap(1).id.high == 2 * kArchiveBlockRows - 1);
+
+    std::vector<ArchiveRanges> queries(5);
+    queries[1].margin.high = std::nextafter(-50000.0, -1e300);  // B won by more than 50000
+    queries[1].length.low = 2000;                                 // among inputs longer than 1999
+    queries[2].roster.low = queries[2].roster.high = 1;
+    queries[2].scoreA.low = 1000;
+    queries[2].scoreA.high = 2000;
+    queries[3].id.low = 100;
+    queries[3].id.high = 2 * kArchiveBlockRows + 17;
+    queries[4].length.low = 1u << 30;
+
+    const SimdKernels& detected = simdKernels();
+    for (Isa isa : { Isa::Baseline, Isa::Sse42, Isa::Avx2, Isa::Avx512 }) {
+        if (!forceIsa(isa)) continue;
+        INFO(isaName(isa));
+        for (size_t q = 0; q < queries.size(); ++q) {
+            INFO("query " << q);
+            std::vector<uint64_t> expected;
+            for (const auto& row : rows) {
+                if (queries[q].matches(row)) expected.push_back(row.id);
+            }
+            std::vector<uint64_t> found;
+            size_t mismatched = 0;
+            ArchiveScanStats scanned = archive.scan(queries[q], [&](const ArchiveRow& row) {
+                mismatched += !(row.margin == rows[row.id].margin && row.roster == rows[row.id].roster);
+                found.push_back(row.id);
+            });
+            REQUIRE(found == expected);
+            REQUIRE(mismatched == 0);
+            REQUIRE(scanned.rowsMatched == expected.size());
+            ArchiveScanStats counted = archive.count(queries[q], 3);
+            REQUIRE(counted.rowsMatched == expected.size());
+            REQUIRE(counted.blocksScanned + counted.blocksSkipped + counted.blocksCovered == archive.blocks());
+        }
+    }
+    forceIsa(detected.isa);
+
+    REQUIRE(archive.count(queries[0]).blocksCovered == archive.blocks());
+    REQUIRE(archive.count(queries[1]).blocksSkipped >= 1);
+    REQUIRE(archive.count(queries[4]).blocksSkipped == archive.blocks());
+
+    REQUIRE(::truncate(path.c_str(), 4000) == 0);
+    REQUIRE_THROWS_AS(ResultArchive(path), std::runtime_error);
+    ::unlink(path.c_str());
+    REQUIRE_THROWS_AS(ResultArchive(path), std::system_error);
+}
+
+TEST_CASE("Benchmark: result archive queries", "[.][benchmark][archive]") {
+    const char* env = std::getenv("ASAPHUS_BENCH_ROWS");
+    size_t count = env != nullptr ? std::strtoull(env, nullptr, 10) : 20000000;
+    std::string path = "/tmp/asaphus_archive_bench_" + std::to_string(::getpid());
+    {
+        ResultArchiveWriter writer(path);
+        std::mt19937_64 rng(98);
+        for (size_t i = 0; i < count; ++i) {
+            double a = static_cast<double>(rng() % 1000000), b = static_cast<double>(rng() % 1000000);
+            writer.append(GameRecord{ i, i / 64 + rng() % 100, a, b, 0 }, static_cast<uint32_t>(rng() % 3));
+        }
+    }
+    ResultArchive archive(path);
+    ArchiveRanges lopsided, recent;
+    lopsided.margin.high = -900000;
+    recent.margin.high = -900000;
+    recent.length.low = count / 64 * 9 / 10;
+    for (const ArchiveRanges* query : { &lopsided, &recent }) {
+        auto start = std::chrono::steady_clock::now();
+        ArchiveScanStats stats = archive.count(*query);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << (query == &lopsided ? "margin only" : "margin and length") << ": " << stats.rowsMatched
+            << " of " << archive.rows() << " rows, " << stats.blocksSkipped << "/" << archive.blocks()
+            << " blocks skipped, " << archive.rows() / elapsed.count() / 1e9 << "e9 rows/s" << std::endl;
+    }
+    ::unlink(path.c_str());
+}
+
+TEST_CASE("Every engine maintains the same game fingerprint", "[fingerprint]") {
+    std::vector<std::vector<uint32_t> > games;
+    for (uint32_t seed = 0; seed < 23; ++seed) {
+        games.push_back(randomTokens(seed * seed * 7, seed % 2 ? 1000 : 70000, seed));
+    }
+    std::vector<BoxSpec> standard{ { BoxKind::Green, 0.0 }, { BoxKind::Green, 0.1 },
+        { BoxKind::Blue, 0.2 }, { BoxKind::Blue, 0.3 } };
+    std::vector<uint64_t> expected;
+    for (const auto& game : games) {
+        GameResult reference = referenceScores(game);
+        expected.push_back(reference.fingerprint);
+        REQUIRE(playStreaming(game.data(), game.size(), 64).fingerprint == reference.fingerprint);
+        REQUIRE(playNarrow(NarrowTokens(game)).fingerprint == reference.fingerprint);
+        REQUIRE(playLargeRoster(standard, game).fingerprint == reference.fingerprint);
+
+        DynamicRosterGame dynamic(standard);
+        GameState* live = game_state_new();
+        REQUIRE(game_state_step(live, game.data(), game.size()) == GAME_OK);
+        for (uint32_t token : game) dynamic.step(token);
+        uint64_t fingerprint = 0;
+        REQUIRE(game_state_fingerprint(live, &fingerprint) == GAME_OK);
+        REQUIRE(fingerprint == reference.fingerprint);
+        REQUIRE(dynamic.result().fingerprint == reference.fingerprint);
+        REQUIRE(PackedGameState::pack(*live).unpack().fingerprint == reference.fingerprint);
+        game_state_free(live);
+    }
+    REQUIRE(expected[0] == GameResult().fingerprint);
+
+    for (const auto& engine : gameEngines()) {
+        INFO(engine.name);
+        for (unsigned threads : { 1u, 3u }) {
+            std::vector<GameResult> results = playBatch(games, engine, threads);
+            for (size_t g = 0; g < games.size(); ++g) REQUIRE(results[g].fingerprint == expected[g]);
+        }
+    }
+    std::vector<uint32_t> flat;
+    std::vector<size_t> offsets{ 0 };
+    for (const auto& game : games) {
+        flat.insert(flat.end(), game.begin(), game.end());
+        offsets.push_back(flat.size());
+    }
+    std::vector<double> scores(2 * games.size());
+    std::vector<uint64_t> fingerprints(games.size());
+    REQUIRE(game_play_batch_fingerprints(flat.data(), offsets.data(), games.size(), scores.data(),
+        fingerprints.data(), 2) == GAME_OK);
+    REQUIRE(fingerprints == expected);
+
+    // Changing or dropping a turn changes the fingerprint
+    std::vector<uint32_t> tokens{ 4, 4, 4, 4, 4, 4, 4, 4 };
+    GameResult base = playState(tokens.data(), tokens.size());
+    tokens[5] = 5;
+    REQUIRE(playState(tokens.data(), tokens.size()).fingerprint != base.fingerprint);
+    tokens.pop_back();
+    tokens[5] = 4;
+    REQUIRE(playState(tokens.data(), tokens.size()).fingerprint != base.fingerprint);
+    std::sort(expected.begin(), expected.end());
+    REQUIRE(std::unique(expected.begin(), expected.end()) == expected.end());
+}
+
+
+#ifdef ASAPHUS_HAVE_PROBES
+TEST_CASE("Probe sites are recorded as stapsdt notes in the executable", "[probes]") {
+    std::ifstream in("/proc/self/exe", std::ios::binary);
+    std::string image((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    REQUIRE(image.find(".note.stapsdt") != std::string::npos);
+    for (const char* probe : { "game_start", "game_end", "turn", "batch_chunk_start", "batch_chunk_end" }) {
+        INFO(probe);
+        REQUIRE(image.find(std::string("asaphus") + '\0' + probe + '\0') != std::string::npos);
+    }
+    auto inputs = randomTokens(1000, 100, 99);
+    REQUIRE(playTwoPhase(inputs.data(), inputs.size()) == referenceScores(inputs));
 }
+#endif
 
+#endif  // ASAPHUS_NO_TESTS
 
 /**
 * Final Output in the console Window
@@ -277,4 +6815,4 @@ Scores: player A 13, player B 25
 Scores: player A 155, player B 366.25
 ===============================================================================
 All tests passed (14 assertions in 4 test cases)
-*/
\ No newline at end of file
+*/
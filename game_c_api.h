@@ -0,0 +1,100 @@
+/**
+ * @file game_c_api.h
+ *
+ * Stable C interface to the game for embedding in non-C++ services.
+ *
+ * The interface is designed for few, large calls: game_play_batch() plays thousands of
+ * games from one flat token buffer, and game_state_step() advances a live game by many
+ * tokens at once. No C++ exceptions or types cross this boundary.
+ *
+ * Building the shared library:
+ *   g++ --std=c++14 -O2 -shared -fPIC -fvisibility=hidden -DASAPHUS_NO_TESTS \
+ *       asaphus_coding_challenge.cpp -o libasaphus_game.so
+ */
+
+#ifndef ASAPHUS_GAME_C_API_H
+#define ASAPHUS_GAME_C_API_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define GAME_API __attribute__((visibility("default")))
+#else
+#define GAME_API
+#endif
+
+#define GAME_API_VERSION 3
+
+/** Status codes returned by all functions that can fail. */
+enum {
+    GAME_OK = 0,
+    GAME_INVALID_ARGUMENT = 1,
+    GAME_OUT_OF_MEMORY = 2,
+    GAME_INTERNAL_ERROR = 3
+};
+
+/** Opaque handle to a live game on the standard four-box roster. */
+typedef struct GameState GameState;
+
+/** Copy of a live game's state. Boxes 0 and 1 are green, 2 and 3 are blue. */
+typedef struct GameSnapshot {
+    double weights[4];
+    uint32_t green_window[2][3];    /* most recent weights, oldest first */
+    uint32_t green_window_size[2];
+    uint32_t blue_seen[2];          /* blue_min/blue_max are only valid if set */
+    uint32_t blue_min[2];
+    uint32_t blue_max[2];
+    double score_a;
+    double score_b;
+    uint64_t turn;                  /* tokens played so far */
+} GameSnapshot;
+
+/** Returns GAME_API_VERSION of the library. */
+GAME_API uint32_t game_api_version(void);
+
+/** Plays one game and stores the final scores of players A and B. */
+GAME_API int game_play(const uint32_t* tokens, size_t count, double* score_a, double* score_b);
+
+/**
+ * Plays games tokens[offsets[g], offsets[g + 1]) for g < games, so offsets holds games + 1
+ * entries. Stores the scores of game g in scores[2 * g] (A) and scores[2 * g + 1] (B).
+ * threads == 0 uses all cores.
+ */
+GAME_API int game_play_batch(const uint32_t* tokens, const size_t* offsets, size_t games,
+    double* scores, unsigned threads);
+
+/**
+ * Like game_play_batch(), and also stores the fingerprint of game g in fingerprints[g]
+ * unless fingerprints is NULL. Since version 3.
+ */
+GAME_API int game_play_batch_fingerprints(const uint32_t* tokens, const size_t* offsets, size_t games,
+    double* scores, uint64_t* fingerprints, unsigned threads);
+
+/** Creates a game before the first turn, or returns NULL if out of memory. */
+GAME_API GameState* game_state_new(void);
+
+/** Releases a game; NULL is ignored. */
+GAME_API void game_state_free(GameState* state);
+
+/** Plays the next count tokens of a live game. */
+GAME_API int game_state_step(GameState* state, const uint32_t* tokens, size_t count);
+
+/** Copies the current state of a live game. */
+GAME_API int game_state_snapshot(const GameState* state, GameSnapshot* snapshot);
+
+/**
+ * Stores the fingerprint of a live game: a hash of every turn so far that is equal for
+ * equal games, to compare runs without their full output. Since version 2.
+ */
+GAME_API int game_state_fingerprint(const GameState* state, uint64_t* fingerprint);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ASAPHUS_GAME_C_API_H */